@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "utf8_skip.hpp"
+
+struct BlockReaderConfig {
+  size_t block_size = 1 << 20;  // Bytes per read, rounded up to a multiple of u8simd::size()
+  uint32_t depth    = 4;  // Blocks in flight, also the number of recycled buffers
+  uint32_t threads  = 2;  // pread workers when io_uring isn't used
+  bool io_uring     = true;  // Only has an effect when built with UTF8_SKIP_IO_URING
+};
+
+// Receives blocks in file order. The buffer is recycled once this returns, so it must not be kept.
+// The last block is zero padded up to the next u8simd, bytes is the real length of the block
+using BlockConsumer = std::function<void(u8simd_sv block, size_t file_offset, size_t bytes)>;
+
+// Reads the file into aligned blocks while the consumer is scanning the previous ones so that I/O
+// and compute overlap. Returns the file size, throws std::runtime_error on I/O errors
+size_t readBlocks(const std::string &path, const BlockConsumer &consume, const BlockReaderConfig &config = {});
+
+// mark_utf8_bytes2 over a whole file through readBlocks, overflow is carried across blocks. Auto is
+// resolved with the file size, so every block of a large file streams
+u8mask_vec mark_utf8_file(const std::string &path,
+  const BlockReaderConfig &config = {},
+  MarkMode mode                   = MarkMode::Auto);
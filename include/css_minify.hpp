@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "utf8_skip.hpp"
+
+// Extra bytes minifyCss may write past the end of its output
+constexpr size_t minify_padding = 16;
+
+// Region of the CSS scan carried from one 64 byte block to the next
+struct CssScanState {
+  enum Region : uint8_t { Normal, DoubleQuoted, SingleQuoted, Comment };
+
+  Region region        = Normal;
+  uint8_t escape_carry = 0;  // First bytes of this block escaped by a backslash at the end of the previous one
+  bool drop_carry      = false;  // First byte of this block is the '/' closing a comment
+  uint64_t sep_carry   = 1;  // Previous byte was a separator, starts set to drop leading whitespace
+  size_t comment_end   = 0;  // First offset where a "*/" may close the current comment
+
+  // Walks the structural bits (quotes, backslashes and the first byte of "/*" or "*/") of the block
+  // at base in order, plus the newlines ('\n', '\r', '\f') while inside a string since an unescaped
+  // one ends it as a bad string. Returns the bytes inside strings or escaped in protect, comment bytes
+  // in drop and the opening quotes and closing quotes or newlines of strings in bounds
+  void resolve(const uint8_t *in,
+    size_t bytes,
+    size_t base,
+    uint64_t structural,
+    uint64_t newlines,
+    uint64_t &protect,
+    uint64_t &drop,
+    uint64_t &bounds);
+};
+
+// Byte range [start, end) of a string token, its quotes included
+struct CssStringSpan {
+  size_t start;
+  size_t end;
+};
+
+// Strips comments and collapses whitespace runs to a single space, strings (ended by an unescaped
+// newline as in CSS Syntax) and escapes are left alone. out needs room for bytes + minify_padding,
+// returns the minified size. The pointer overload takes any buffer, no alignment or padding needed
+size_t minifyCss(const uint8_t *in, size_t bytes, uint8_t *out);
+size_t minifyCss(u8simd_sv data, size_t bytes, uint8_t *out);
+u8string minifyCss(u8simd_sv data, size_t bytes);
+
+// Finds the string tokens outside of comments. Like in CSS Syntax an unescaped newline ends a string
+// before the newline (a bad string) and the end of the input ends an open one. Writes up to capacity
+// spans and returns how many strings there are, so a first call with capacity 0 sizes spans
+size_t indexCssStrings(const uint8_t *in, size_t bytes, CssStringSpan *spans, size_t capacity);
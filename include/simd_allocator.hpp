@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Backing of the allocations from huge_page_size up, smaller ones come from aligned operator new
+enum class HugePages {
+  None,  // Plain anonymous mappings on 4K pages
+  Transparent,  // 2M aligned mappings with madvise(MADV_HUGEPAGE)
+  Explicit,  // MAP_HUGETLB from the reserved pool, Transparent when the pool is empty
+};
+
+constexpr size_t huge_page_size = size_t(2) << 20;
+
+// Only changes the allocations made after the call
+void setHugePagePolicy(HugePages policy);
+HugePages hugePagePolicy();
+
+void *allocateSimd(size_t bytes, size_t alignment);
+void deallocateSimd(void *ptr, size_t bytes, size_t alignment);
+
+// Aligned allocator for the simd strings and mask vectors. Large buffers get huge pages to cut the
+// dTLB misses of scans over hundreds of MB
+template<typename T>
+struct SimdAllocator {
+  using value_type = T;
+  // The flag below only changes how elements are constructed, any instance can free any buffer
+  using is_always_equal = std::true_type;
+
+  bool default_init = false;  // Zero argument construct leaves the element uninitialised
+
+  SimdAllocator() = default;
+  template<typename U>
+  SimdAllocator(const SimdAllocator<U> &other) : default_init(other.default_init) {}
+
+  static SimdAllocator uninitialised() {
+    SimdAllocator allocator;
+    allocator.default_init = true;
+    return allocator;
+  }
+  // Copies of a container value initialise again
+  SimdAllocator select_on_container_copy_construction() const { return {}; }
+
+  T *allocate(size_t n) { return static_cast<T *>(allocateSimd(n * sizeof(T), alignof(T))); }
+  void deallocate(T *ptr, size_t n) { deallocateSimd(ptr, n * sizeof(T), alignof(T)); }
+
+  template<typename U, typename... Args>
+  void construct(U *ptr, Args &&...args) {
+    if constexpr (sizeof...(Args) == 0) {
+      if (default_init) {
+        ::new (static_cast<void *>(ptr)) U;
+        return;
+      }
+    }
+    ::new (static_cast<void *>(ptr)) U(std::forward<Args>(args)...);
+  }
+
+  template<typename U>
+  bool operator==(const SimdAllocator<U> &) const {
+    return true;
+  }
+};
+
+// Vector whose size constructor and resize skip the zero fill, for outputs the marking passes write
+// in full right away. The zero fill would be one more pass over the whole output
+template<typename T>
+std::vector<T, SimdAllocator<T>> uninitialisedVector(size_t n = 0) {
+  return std::vector<T, SimdAllocator<T>>(n, SimdAllocator<T>::uninitialised());
+}
+
+// Moves the buffer of an uninitialisedVector into one with the plain allocator, without a copy, so
+// callers get a vector which value initialises like any other
+template<typename T>
+std::vector<T, SimdAllocator<T>> releaseVector(std::vector<T, SimdAllocator<T>> &&vec) {
+  return std::vector<T, SimdAllocator<T>>(std::move(vec), SimdAllocator<T>());
+}
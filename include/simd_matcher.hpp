@@ -0,0 +1,257 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <ranges>
+#include <utility>
+
+#include "utf8_skip.hpp"
+
+inline const u8simd chunk_bsls = uint8_t('\\');
+
+struct SimdOffset {
+  int64_t index;
+  int offset;
+};
+
+// Quote matching over simd strings, header only so it is usable outside of the simd_string demo
+struct SimdMatcher {
+  struct ChunkOverflow1 {
+    u8simd o1;
+    void set(u8simd &chunk) { o1 = shiftElementLeft<u8simd::size() - 1>(chunk); }
+  };
+  struct ChunkOverflow2 : ChunkOverflow1 {
+    u8simd o2;
+    void set(u8simd &chunk) {
+      o2 = shiftElementLeft<u8simd::size() - 2>(chunk);
+      ChunkOverflow1::set(chunk);
+    }
+  };
+  struct ChunkOverflow3 : ChunkOverflow2 {
+    u8simd o3;
+    void set(u8simd &chunk) {
+      o3 = shiftElementLeft<u8simd::size() - 3>(chunk);
+      ChunkOverflow2::set(chunk);
+    }
+  };
+
+  u8mask maskUtf8Chunk(u8simd &chunk) {
+    auto chunk_s1 = shiftElementRight<1>(chunk);
+    auto chunk_s2 = shiftElementRight<2>(chunk);
+    auto chunk_s3 = shiftElementRight<3>(chunk);
+
+    constexpr auto size = sizeof(u8simd::value_type);
+    // Identify lead chunks of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
+    u8mask mask = chunk >= 0xC0;  // Mark lead byte
+    mask |= chunk_s1 >= 0xC0;  // Mark 2nd byte
+    mask |= chunk_s2 >= 0xE0;  // Mark 3rd byte
+    mask |= chunk_s3 >= 0xF0;  // Mark 4th byte
+    return mask;
+  }
+
+  u8mask maskUtf8AndEscChunk(u8simd &chunk) {
+    auto chunk_s1 = shiftElementRight<1>(chunk);
+    auto chunk_s2 = shiftElementRight<2>(chunk);
+    auto chunk_s3 = shiftElementRight<3>(chunk);
+
+    constexpr auto size = sizeof(u8simd::value_type);
+    // Identify lead chunks of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
+    u8mask mask = chunk >= 0xC0;  // Mark lead byte
+    mask |= chunk_s1 >= 0xC0;  // Mark 2nd byte
+    mask |= chunk_s1 == chunk_bsls;  // Mask Escape byte letters
+    mask |= chunk_s2 >= 0xE0;  // Mark 3rd byte
+    mask |= chunk_s3 >= 0xF0;  // Mark 4th byte
+    return mask;
+  }
+  u8mask maskUtf8ChunkSafe(u8simd &chunk, ChunkOverflow3 &overflow) {
+    auto chunk_sr1 = shiftElementRight<1>(chunk);
+    auto chunk_sr2 = shiftElementRight<2>(chunk);
+    auto chunk_sr3 = shiftElementRight<3>(chunk);
+
+    // Take care of overflow
+    chunk_sr1 |= overflow.o1;
+    chunk_sr2 |= overflow.o2;
+    chunk_sr3 |= overflow.o3;
+
+    constexpr auto size = sizeof(u8simd::value_type);
+    // Identify lead bytes of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
+    u8mask mask = chunk >= 0xC0;  // Mark lead byte
+    mask |= chunk_sr1 >= 0xC0;  // Mark 2nd byte
+    mask |= chunk_sr2 >= 0xE0;  // Mark 3rd byte
+    mask |= chunk_sr3 >= 0xF0;  // Mark 4th byte
+    return mask;
+  }
+
+
+  u8mask maskUtf8AndEscChunkSafe(u8simd &chunk, ChunkOverflow3 &overflow) {
+    auto chunk_sr1 = shiftElementRight<1>(chunk);
+    auto chunk_sr2 = shiftElementRight<2>(chunk);
+    auto chunk_sr3 = shiftElementRight<3>(chunk);
+
+    // Take care of overflow
+    chunk_sr1 |= overflow.o1;
+    chunk_sr2 |= overflow.o2;
+    chunk_sr3 |= overflow.o3;
+
+    constexpr auto size = sizeof(u8simd::value_type);
+    // Identify lead bytes of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
+    u8mask mask = chunk >= 0xC0;  // Mark lead byte
+    mask |= chunk_sr1 >= 0xC0;  // Mark 2nd byte
+    mask |= chunk_sr1 == chunk_bsls;  // Check for escape adn mask it
+    mask |= chunk_sr2 >= 0xE0;  // Mark 3rd byte
+    mask |= chunk_sr3 >= 0xF0;  // Mark 4th byte
+    return mask;
+  }
+  u8mask maskEscCharChunk(u8simd &chunk) {
+    const auto chunk_sr1 = shiftElementRight<1>(chunk);
+    const u8simd cmp     = chunk_bsls;
+
+    // u8mask mask = chunk == cmp;
+    u8mask mask = chunk_sr1 == cmp;
+    return mask;
+  }
+
+  u8mask maskEscCharChunkSafe(u8simd &chunk, ChunkOverflow1 &overflow) {
+    auto chunk_sr1   = shiftElementRight<1>(chunk);
+    const u8simd cmp = chunk_bsls;
+
+    chunk_sr1 |= overflow.o1;
+
+    // I mean, we can skip this :P
+    // u8mask mask = chunk == cmp;
+    u8mask mask = chunk_sr1 == cmp;
+    return mask;
+  }
+
+
+  SimdOffset matchString(u8simd_str &str, char8_t type, uint32_t offset = 0, uint32_t init_chunk_idx = 0) {
+    namespace stdr  = std::ranges;
+    namespace stdrv = stdr::views;
+    if (str.size() <= offset) return { offset, -1 };
+    ChunkOverflow3 chunk_overflow{};
+
+    auto first_mask = str[offset] == type;
+    // set only the bytes which aren't utf8 and escape chars
+    first_mask &= !maskUtf8AndEscChunk(str[offset]);
+
+    auto quote_count = stdx::popcount(first_mask);
+    if (quote_count == 0) return { offset, -1 };
+    // I think we can afford this for the sake of per u8simd alignment
+    int index = stdx::find_last_set(first_mask);
+
+    auto index_valid_early_ret = quote_count > 1 && index > init_chunk_idx;
+    if (index_valid_early_ret || str.size() == 1) return { offset, index };
+
+    chunk_overflow.set(str[offset]);
+    u8simd quote = str[offset][index];
+    auto x       = 0u;
+
+    for (u8simd chunk : str | stdrv::drop(offset + 1)) {
+      auto utf8_mask = maskUtf8AndEscChunkSafe(chunk, chunk_overflow);
+      // auto esc_mask  = maskEscCharChunkSafe(chunk, chunk_overflow);
+      // If we found an unescaped quote in the chunk
+      auto end_quote_mask       = chunk == quote;
+      auto valid_end_quote_mask = end_quote_mask && !utf8_mask;
+
+      if (stdx::any_of(valid_end_quote_mask)) {
+        auto index = stdx::find_first_set(valid_end_quote_mask);
+        return { x, index };
+      }
+      // Reassign overflow buffer
+      chunk_overflow.set(chunk);
+      x++;
+    }
+    return { offset, -1 };
+  }
+
+  // Per document state of an interleaved scan, same as the locals of matchString
+  struct MatchLane {
+    const u8simd *data;
+    size_t size;
+    u8simd quote;
+    ChunkOverflow3 overflow;
+    uint32_t x;
+    bool done;
+  };
+
+  // Scans N independent documents in lockstep, each lane with its own overflow chain. Results are
+  // the same as calling matchString on every document separately.
+  template<size_t N>
+    requires(N >= 1 && N <= 4)
+  std::array<SimdOffset, N> matchStrings(const std::array<u8simd_str *, N> &strs,
+    char8_t type,
+    uint32_t offset         = 0,
+    uint32_t init_chunk_idx = 0) {
+    static const u8simd zero_chunk{};
+
+    std::array<SimdOffset, N> results;
+    std::array<MatchLane, N> lanes;
+    size_t longest = 0;
+    size_t active  = 0;
+
+    for (size_t d = 0; d < N; d++) {
+      u8simd_str &str = *strs[d];
+      MatchLane &lane = lanes[d];
+      lane            = { str.data(), str.size(), {}, {}, 0, true };
+      results[d]      = { offset, -1 };
+      if (str.size() <= offset) continue;
+
+      auto first_mask = str[offset] == type;
+      first_mask &= !maskUtf8AndEscChunk(str[offset]);
+
+      auto quote_count = stdx::popcount(first_mask);
+      if (quote_count == 0) continue;
+      int index = stdx::find_last_set(first_mask);
+
+      auto index_valid_early_ret = quote_count > 1 && index > int(init_chunk_idx);
+      if (index_valid_early_ret || str.size() == 1) {
+        results[d] = { offset, index };
+        continue;
+      }
+
+      lane.overflow.set(str[offset]);
+      lane.quote = str[offset][index];
+      lane.done  = false;
+      longest    = std::max(longest, str.size());
+      active++;
+    }
+
+    for (size_t i = offset + 1; i < longest && active > 0; i++) {
+      // Every lane runs its step without branching on the others, the fold keeps the lane index a
+      // constant so the lanes stay in registers. Finished lanes read a zero chunk, which matches the
+      // zero quote of a lane that never started, the done check below drops those hits
+      std::array<u8mask, N> end_quote_masks;
+      uint32_t hits = 0;
+      auto step     = [&](MatchLane &lane, size_t d) {
+        u8simd chunk       = (!lane.done && i < lane.size) ? lane.data[i] : zero_chunk;
+        auto utf8_mask     = maskUtf8AndEscChunkSafe(chunk, lane.overflow);
+        end_quote_masks[d] = chunk == lane.quote && !utf8_mask;
+        hits |= uint32_t(stdx::any_of(end_quote_masks[d])) << d;
+        lane.overflow.set(chunk);
+      };
+      [&]<size_t... D>(std::index_sequence<D...>) { (step(lanes[D], D), ...); }(std::make_index_sequence<N>{});
+
+      // Only a lane that found its closing quote takes this branch
+      while (hits != 0) {
+        size_t d        = std::countr_zero(hits);
+        MatchLane &lane = lanes[d];
+        hits &= hits - 1;
+        if (lane.done) continue;
+        results[d] = { lane.x, stdx::find_first_set(end_quote_masks[d]) };
+        lane.done  = true;
+        active--;
+      }
+
+      for (size_t d = 0; d < N; d++) {
+        MatchLane &lane = lanes[d];
+        if (!lane.done && i + 1 >= lane.size) {
+          lane.done = true;
+          active--;
+        }
+        lane.x++;
+      }
+    }
+    return results;
+  }
+};
@@ -0,0 +1,98 @@
+#pragma once
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "utf8_skip.hpp"
+
+// Rank index over the code point starts (non continuation bytes) of a UTF-8 buffer. Every 64 byte
+// block keeps the count of starts before it relative to its superblock in 16 bits, that is ~3% of
+// the input, and every select_sample-th code point the block it is in. Bits inside a block are
+// recomputed from the data on lookup, so both directions of the byte <-> code point conversion are
+// a couple of loads and popcounts instead of a walk
+struct Utf8RankIndex {
+  static constexpr size_t block_bytes      = 64;
+  static constexpr size_t superblock_bytes = 1 << 15;  // Relative counts stay below uint16 max
+  static constexpr size_t blocks_per_super = superblock_bytes / block_bytes;
+  static constexpr size_t select_sample    = 1024;  // Code points between two select samples
+
+  // Builds the index over the first bytes of data, data must outlive the index
+  Utf8RankIndex(u8simd_sv data, size_t bytes);
+
+  size_t size() const { return bytes; }
+  size_t codePoints() const { return code_points; }
+
+  // Code points starting before byte_offset, for a lead byte that is the index of its code point
+  size_t toCodePoint(size_t byte_offset) const;
+  // Byte offset where the code point starts, size() when it is past the end. Searches the blocks
+  // between two samples, valid UTF-8 has at least 16 code points per block so that is at most 64
+  size_t toByteOffset(size_t code_point) const;
+
+  // Bit i is set when byte block * 64 + i starts a code point
+  uint64_t blockBits(size_t block) const;
+  // Code points before the block
+  size_t countBefore(size_t block) const { return superblocks[block / blocks_per_super] + blocks[block]; }
+
+  u8simd_sv data;
+  size_t bytes;
+  size_t code_points = 0;
+  std::vector<uint64_t> superblocks;  // Code points before each superblock
+  std::vector<uint16_t> blocks;  // Code points before each block, relative to its superblock
+  std::vector<size_t> samples;  // Block holding code point j * select_sample
+};
+
+struct LinePosition {
+  size_t line;  // 0 based
+  size_t column;  // 0 based, bytes unless converted through a Utf8RankIndex
+};
+
+// Newline bitmaps of a buffer with the count of newlines before each 64 byte block, kept like the
+// counts of Utf8RankIndex: 16 bits relative to a superblock. The bitmaps are another 1/8 of the
+// input since the index doesn't keep the data. It is filled chunk by chunk by the marking pass, so
+// line:col lookups don't need a second scan
+struct Utf8LineIndex {
+  static constexpr size_t block_bytes      = 64;
+  static constexpr size_t superblock_bytes = 1 << 15;  // Relative counts stay below uint16 max
+  static constexpr size_t blocks_per_super = superblock_bytes / block_bytes;
+
+  void append(const u8simd &chunk) {
+    size_t shift = (chunks * u8simd::size()) % block_bytes;
+    if (shift == 0) {
+      if (!newlines.empty()) newlines_before += std::popcount(newlines.back());
+      if (newlines.size() % blocks_per_super == 0) superblocks.push_back(newlines_before);
+      lines.push_back(uint16_t(newlines_before - superblocks.back()));
+      newlines.push_back(0);
+    }
+    newlines.back() |= maskBits(chunk == chunk_newline) << shift;
+    chunks++;
+  }
+
+  size_t lineCount() const { return newlines.empty() ? 1 : newlines_before + std::popcount(newlines.back()) + 1; }
+  // Byte offset of the first byte of the line
+  size_t lineStart(size_t line) const;
+
+  LinePosition position(size_t byte_offset) const;
+  // Same as position with the column counted in code points
+  LinePosition position(size_t byte_offset, const Utf8RankIndex &index) const;
+
+  // Newlines before the block
+  size_t linesBefore(size_t block) const { return superblocks[block / blocks_per_super] + lines[block]; }
+
+  size_t chunks          = 0;
+  size_t newlines_before = 0;  // Newlines before the last block
+  std::vector<uint64_t> newlines;  // Bit i set when byte block * 64 + i is a newline
+  std::vector<uint64_t> superblocks;  // Newlines before each superblock
+  std::vector<uint16_t> lines;  // Newlines before each block, relative to its superblock
+};
+
+// mark_utf8_bytes2 which also fills the line index in the same pass, modes are resolved the same way
+u8mask_vec mark_utf8_bytes2(u8simd_str &data,
+  Utf8LineIndex &lines,
+  uint32_t offset = 0,
+  MarkMode mode   = MarkMode::Auto);
+void mark_utf8_bytes2(u8simd_sv data,
+  u8mask *masks,
+  Utf8MarkState &state,
+  Utf8LineIndex &lines,
+  MarkMode mode = MarkMode::Auto);
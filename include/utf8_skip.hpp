@@ -7,6 +7,8 @@
 #include <uchar.h>
 #include <vector>
 
+#include "simd_allocator.hpp"
+
 namespace stdx {
 using namespace std::experimental;
 using namespace std::experimental::__proposed;
@@ -19,8 +21,13 @@ using u32simd = stdx::resize_simd_t<u8simd::size() / 4, u8simd>;
 using u8string      = std::basic_string<uint8_t>;
 using u8string_view = std::basic_string_view<uint8_t>;
 
-using u8simd_str = std::basic_string<u8simd>;
+using u8simd_str = std::basic_string<u8simd, std::char_traits<u8simd>, SimdAllocator<u8simd>>;
 using u8simd_sv  = std::basic_string_view<u8simd>;
+using u8mask_vec = std::vector<u8mask, SimdAllocator<u8mask>>;
+
+// A scalar broadcasts in the comparison. As a u8simd it would need a dynamic initialiser, which runs
+// AVX2 code when utf8_skip_c is loaded, before it can check the CPU
+inline constexpr uint8_t chunk_newline = '\n';
 
 constexpr size_t accomodateBytes(size_t size) { return (size / u8simd::size()) + ((size % u8simd::size()) ? 1 : 0); }
 
@@ -123,11 +130,87 @@ auto orFirst32Bits(SimdType auto reg, uint32_t value) {
   }
 }
 
-std::vector<u8mask> mark_utf8_bytes2(u8simd_str &data, uint32_t offset = 0);
-std::vector<u8mask> mark_utf8_bytes(const u8simd_str &data);
+// Packs a mask into an integer, bit i is set for element i
+[[nodiscard]]
+inline uint64_t maskBits(const u8mask &mask) {
+  static_assert(u8mask::size() <= 64, "Mask doesn't fit in 64 bits");
+  static constexpr auto simd_width = u8mask::size() * 8;
+
+  if constexpr (simd_width == 256 && sizeof(u8mask) == 32) {
+    return uint32_t(_mm256_movemask_epi8((const __m256i &)mask));
+  } else if constexpr (simd_width == 128 && sizeof(u8mask) == 16) {
+    return uint16_t(_mm_movemask_epi8((const __m128i &)mask));
+  } else {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < u8mask::size(); i++) bits |= uint64_t(mask[i]) << i;
+    return bits;
+  }
+}
+
+// Marking state carried between chunks, keeps the bytes which overflow into the next chunk so a
+// scan can be resumed on the next buffer of the same stream
+struct Utf8MarkState {
+  // This is very expensive on memory there is no need to maintain entire registers
+  u8simd overflow1{};
+  u8simd overflow2{};
+  u8simd overflow3{};
+
+  u8mask mark(const u8simd &bytes) {
+    auto byte_s1 = shiftElementRight<1>(bytes);
+    auto byte_s2 = shiftElementRight<2>(bytes);
+    auto byte_s3 = shiftElementRight<3>(bytes);
+
+    // pretty damn skeptical of what this produces
+    // stdx::where(mask_b1, byte_s1) = overflow1;
+    byte_s1 |= overflow1;
+    byte_s2 |= overflow2;
+    byte_s3 |= overflow3;
+
+    // Identify lead bytes of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
+    u8mask mask = bytes >= 0xC0;  // Mark lead byte
+    mask |= byte_s1 >= 0xC0;  // Mark 2nd byte
+    mask |= byte_s2 >= 0xE0;  // Mark 3rd byte
+    mask |= byte_s3 >= 0xF0;  // Mark 4th byte
+
+    // Also I should be able to remove this shift just by reversing the overflow
+    overflow3 = shiftElementLeft<u8simd::size() - 3>(bytes);
+    overflow2 = shiftElementLeft<u8simd::size() - 2>(bytes);
+    overflow1 = shiftElementLeft<u8simd::size() - 1>(bytes);
+    return mask;
+  }
+};
+
+enum class MarkMode {
+  Auto,  // Streaming at or above streaming_threshold, Cached below
+  Cached,  // Plain loads and stores
+  Streaming,  // Prefetches the input ahead and writes masks with non temporal stores
+};
+
+// Input size in bytes from which MarkMode::Auto streams. Past the last level cache the masks only
+// evict input which is about to be read
+constexpr size_t streaming_threshold = size_t(32) << 20;
+
+// Picks Cached or Streaming for Auto from the total size of the input, other modes are kept
+constexpr MarkMode resolveMarkMode(MarkMode mode, size_t bytes) {
+  if (mode != MarkMode::Auto) return mode;
+  return bytes >= streaming_threshold ? MarkMode::Streaming : MarkMode::Cached;
+}
+
+u8mask_vec mark_utf8_bytes2(u8simd_str &data, uint32_t offset = 0, MarkMode mode = MarkMode::Auto);
+// Marks data into masks[0, data.size()) continuing from state. Auto only sees this buffer, callers
+// scanning a stream in pieces should resolve it with the size of the whole stream
+void mark_utf8_bytes2(u8simd_sv data, u8mask *masks, Utf8MarkState &state, MarkMode mode = MarkMode::Auto);
+u8mask_vec mark_utf8_bytes(const u8simd_str &data);
+
+// Same marking straight over any byte buffer, bit i of bits is byte i. bits needs (bytes + 63) / 64
+// words, loads are unaligned and the last partial chunk is copied so nothing past bytes is read
+void mark_utf8_bits(const uint8_t *data, size_t bytes, uint64_t *bits);
+// Offset of the first byte which doesn't start a well formed sequence (overlong, surrogate, past
+// U+10FFFF, truncated or a stray continuation byte), bytes if all of data is valid UTF-8
+size_t validate_utf8(const uint8_t *data, size_t bytes);
 
 u8simd_str stringToSimd(const std::string &string);
 u8simd_str readAlignedFile(std::string path);
 
-void printMask(std::vector<u8mask> &masks, size_t max = 20);
-void printMaskMap(std::vector<u8mask> &masks, std::string &utf8_str, size_t max = 500);
+void printMask(u8mask_vec &masks, size_t max = 20);
+void printMaskMap(u8mask_vec &masks, std::string &utf8_str, size_t max = 500);
@@ -0,0 +1,73 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface of the utf8_skip_c shared library, for callers in other runtimes (ctypes, cffi, Rust
+// FFI). Every function works in place on the caller's buffer, which needs no alignment or padding,
+// and keeps no state between calls. Errors come back as a status, nothing ever unwinds out.
+// The library is built for AVX2, on an older CPU every other call returns U8S_UNSUPPORTED_CPU.
+
+#if defined(__GNUC__)
+#define U8S_API __attribute__((visibility("default")))
+#else
+#define U8S_API
+#endif
+
+#ifdef __cplusplus
+#define U8S_NOEXCEPT noexcept
+extern "C" {
+#else
+#define U8S_NOEXCEPT
+#endif
+
+// Bumped on any change to the signatures or structs below
+#define U8S_ABI_VERSION 1
+
+// Words of the bit buffer u8s_mark_utf8 needs for len bytes
+#define U8S_MARK_WORDS(len) (((len) + 63) / 64)
+
+typedef int32_t u8s_status;
+enum {
+  U8S_OK               = 0,
+  U8S_INVALID_ARGUMENT = 1,  // Null pointer with a non zero length
+  U8S_BUFFER_TOO_SMALL = 2,  // The output is filled as far as it goes, see each function for the rest
+  U8S_INVALID_UTF8     = 3,
+  U8S_OUT_OF_MEMORY    = 4,
+  U8S_INTERNAL_ERROR   = 5,
+  U8S_UNSUPPORTED_CPU  = 6,  // No AVX2, nothing was touched
+};
+
+// Byte range [start, end) of a string token, its quotes included
+typedef struct u8s_span {
+  size_t start;
+  size_t end;
+} u8s_span;
+
+// U8S_ABI_VERSION of the loaded library, lets a binding check it wasn't built against another one.
+// Safe to call on any CPU
+U8S_API uint32_t u8s_abi_version(void) U8S_NOEXCEPT;
+
+// Sets bit i (LSB first within each word) when byte i belongs to a multi byte sequence. bits needs
+// U8S_MARK_WORDS(len) words, with fewer the first words * 64 bytes are marked and
+// U8S_BUFFER_TOO_SMALL is returned
+U8S_API u8s_status u8s_mark_utf8(const uint8_t *data, size_t len, uint64_t *bits, size_t words) U8S_NOEXCEPT;
+
+// U8S_OK or U8S_INVALID_UTF8, the whole of table 3-7 of the Unicode standard is checked 32 bytes at a
+// time. error_offset may be null, otherwise it receives the offset of the first invalid sequence, len
+// when the buffer is valid
+U8S_API u8s_status u8s_validate_utf8(const uint8_t *data, size_t len, size_t *error_offset) U8S_NOEXCEPT;
+
+// Finds the CSS string tokens outside of comments. As in CSS Syntax an unescaped newline ('\n', '\r'
+// or '\f') ends a string as a bad string whose span stops before the newline, and a string still
+// open at the end of the buffer ends there. Writes up to capacity spans and the total number of
+// strings to count, so a call with capacity 0 sizes the span buffer. More strings than capacity is
+// U8S_BUFFER_TOO_SMALL with the first capacity spans written
+U8S_API u8s_status u8s_index_css_strings(const uint8_t *data,
+  size_t len,
+  u8s_span *spans,
+  size_t capacity,
+  size_t *count) U8S_NOEXCEPT;
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,232 @@
+#include "block_reader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifdef UTF8_SKIP_IO_URING
+#include <liburing.h>
+#endif
+
+namespace {
+
+std::runtime_error readError(int err) { return std::runtime_error(std::string("Failed to read file: ") + std::strerror(err)); }
+
+struct FileHandle {
+  int fd;
+  explicit FileHandle(const std::string &path) : fd(open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+    if (fd < 0) throw std::runtime_error("Could not open file: " + path);
+  }
+  ~FileHandle() { close(fd); }
+};
+
+// Recycled buffers, block b always lands in slot b % depth
+struct BlockSlots {
+  size_t block_size;
+  size_t file_size;
+  size_t blocks;
+  std::vector<u8simd_str> buffers;
+
+  BlockSlots(const BlockReaderConfig &config, size_t file_size)
+      : block_size(accomodateBytes(std::max<size_t>(config.block_size, 1)) * u8simd::size()), file_size(file_size),
+        blocks((file_size + block_size - 1) / block_size) {
+    size_t depth = std::clamp<size_t>(config.depth, 1, std::max<size_t>(blocks, 1));
+    buffers.assign(depth, u8simd_str(block_size / u8simd::size(), u8simd{}));
+  }
+
+  size_t depth() const { return buffers.size(); }
+  size_t bytesOf(size_t block) const { return std::min(block_size, file_size - block * block_size); }
+  uint8_t *bufferOf(size_t block) { return reinterpret_cast<uint8_t *>(buffers[block % depth()].data()); }
+
+  // Zero pads the rest of the last chunk so the scanner never sees stale bytes of a previous block
+  void deliver(size_t block, const BlockConsumer &consume) {
+    size_t bytes  = bytesOf(block);
+    size_t chunks = accomodateBytes(bytes);
+    std::memset(bufferOf(block) + bytes, 0, chunks * u8simd::size() - bytes);
+    consume(u8simd_sv(buffers[block % depth()].data(), chunks), block * block_size, bytes);
+  }
+};
+
+// Workers claim blocks in order and wait until the consumer hands the slot back
+void readBlocksPread(int fd, BlockSlots &slots, const BlockConsumer &consume, uint32_t threads) {
+  constexpr size_t none = SIZE_MAX;
+  const size_t depth    = slots.depth();
+
+  std::vector<std::atomic<size_t>> filled(depth);  // Block readable from the slot
+  std::vector<std::atomic<size_t>> writable(depth);  // Block allowed to be read into the slot
+  std::atomic<size_t> next_block = 0;
+  std::atomic<int> error         = 0;
+  for (size_t s = 0; s < depth; s++) {
+    filled[s]   = none;
+    writable[s] = s;
+  }
+
+  auto worker = [&] {
+    for (size_t block; (block = next_block.fetch_add(1)) < slots.blocks;) {
+      auto &slot_writable = writable[block % depth];
+      for (size_t v; (v = slot_writable.load()) != block;) {
+        if (v == none) return;
+        slot_writable.wait(v);
+      }
+
+      uint8_t *dst = slots.bufferOf(block);
+      size_t bytes = slots.bytesOf(block);
+      for (size_t done = 0; done < bytes;) {
+        ssize_t res = pread(fd, dst + done, bytes - done, off_t(block * slots.block_size + done));
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) {
+          error = res < 0 ? errno : EIO;
+          break;
+        }
+        done += res;
+      }
+
+      filled[block % depth].store(block);
+      filled[block % depth].notify_all();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  // Also releases workers parked on a slot when the consumer throws
+  auto join = [&] {
+    for (auto &slot_writable : writable) {
+      slot_writable.store(none);
+      slot_writable.notify_all();
+    }
+    for (auto &thread : pool) thread.join();
+  };
+
+  try {
+    for (uint32_t t = 0; t < std::max<uint32_t>(threads, 1); t++) pool.emplace_back(worker);
+
+    for (size_t block = 0; block < slots.blocks; block++) {
+      auto &slot_filled = filled[block % depth];
+      for (size_t v; (v = slot_filled.load()) != block;) slot_filled.wait(v);
+      if (int err = error.load()) throw readError(err);
+
+      slots.deliver(block, consume);
+
+      writable[block % depth].store(block + depth);
+      writable[block % depth].notify_all();
+    }
+  } catch (...) {
+    join();
+    throw;
+  }
+  join();
+}
+
+#ifdef UTF8_SKIP_IO_URING
+// Keeps depth reads queued, completions can come back out of order so blocks are delivered once all
+// of their bytes are in. Returns false if the ring can't be created so the caller can fall back
+bool readBlocksUring(int fd, BlockSlots &slots, const BlockConsumer &consume) {
+  const size_t depth = slots.depth();
+  io_uring ring;
+  if (io_uring_queue_init(unsigned(depth), &ring, 0) < 0) return false;
+
+  size_t in_flight = 0;
+  // Reads still in flight write into our buffers, reap them before tearing the ring down
+  struct RingGuard {
+    io_uring &ring;
+    size_t &in_flight;
+    ~RingGuard() {
+      for (io_uring_cqe *cqe; in_flight > 0 && io_uring_wait_cqe(&ring, &cqe) == 0; in_flight--)
+        io_uring_cqe_seen(&ring, cqe);
+      io_uring_queue_exit(&ring);
+    }
+  } guard{ ring, in_flight };
+
+  std::vector<size_t> read(depth, 0);  // Bytes read into each slot
+  auto submit = [&](size_t block) {
+    size_t done       = read[block % depth];
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_read(sqe,
+      fd,
+      slots.bufferOf(block) + done,
+      unsigned(slots.bytesOf(block) - done),
+      block * slots.block_size + done);
+    io_uring_sqe_set_data64(sqe, block);
+    // Only a read the kernel took is in flight, the guard would wait forever for one it never got.
+    // EAGAIN and EBUSY are transient, the completion queue is twice depth so it never overflows
+    int ret;
+    while ((ret = io_uring_submit(&ring)) == -EAGAIN || ret == -EBUSY || ret == -EINTR) std::this_thread::yield();
+    if (ret < 0) throw readError(-ret);
+    in_flight++;
+  };
+
+  for (size_t block = 0; block < std::min(depth, slots.blocks); block++) submit(block);
+
+  for (size_t block = 0; block < slots.blocks; block++) {
+    while (read[block % depth] < slots.bytesOf(block)) {
+      io_uring_cqe *cqe = nullptr;
+      if (int ret = io_uring_wait_cqe(&ring, &cqe); ret < 0) {
+        if (ret == -EINTR) continue;
+        throw readError(-ret);
+      }
+      size_t done_block = io_uring_cqe_get_data64(cqe);
+      int res           = cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+      in_flight--;
+
+      if (res == -EINTR || res == -EAGAIN) {
+        submit(done_block);
+        continue;
+      }
+      if (res <= 0) throw readError(res < 0 ? -res : EIO);
+      read[done_block % depth] += res;
+      // Short read, queue the rest of the block
+      if (read[done_block % depth] < slots.bytesOf(done_block)) submit(done_block);
+    }
+
+    slots.deliver(block, consume);
+
+    read[block % depth] = 0;
+    if (block + depth < slots.blocks) submit(block + depth);
+  }
+  return true;
+}
+#endif
+
+}  // namespace
+
+size_t readBlocks(const std::string &path, const BlockConsumer &consume, const BlockReaderConfig &config) {
+  FileHandle file(path);
+  struct stat st {};
+  if (fstat(file.fd, &st) < 0) throw readError(errno);
+  if (st.st_size == 0) return 0;
+
+  posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  BlockSlots slots(config, size_t(st.st_size));
+
+#ifdef UTF8_SKIP_IO_URING
+  if (config.io_uring && readBlocksUring(file.fd, slots, consume)) return slots.file_size;
+#endif
+  readBlocksPread(file.fd, slots, consume, config.threads);
+  return slots.file_size;
+}
+
+u8mask_vec mark_utf8_file(const std::string &path, const BlockReaderConfig &config, MarkMode mode) {
+  size_t file_size = std::filesystem::file_size(path);
+  mode             = resolveMarkMode(mode, file_size);
+  auto masks = uninitialisedVector<u8mask>();
+  masks.reserve(accomodateBytes(file_size));
+
+  Utf8MarkState state;
+  readBlocks(
+    path,
+    [&](u8simd_sv block, size_t file_offset, size_t) {
+      size_t first = file_offset / u8simd::size();
+      masks.resize(first + block.size());
+      mark_utf8_bytes2(block, masks.data() + first, state, mode);
+    },
+    config);
+  return releaseVector(std::move(masks));
+}
@@ -0,0 +1,366 @@
+#include "css_minify.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <immintrin.h>
+#include <string_view>
+
+namespace {
+
+constexpr size_t block_bytes      = 64;
+constexpr size_t chunk_bytes      = sizeof(__m256i);
+constexpr size_t chunks_per_block = block_bytes / chunk_bytes;
+static_assert(block_bytes % chunk_bytes == 0, "Block has to be made of whole chunks");
+
+// Bits [from, to) of a block, both ends may go past 64
+constexpr uint64_t bitRange(size_t from, size_t to) {
+  uint64_t below_to   = to >= 64 ? ~uint64_t(0) : (uint64_t(1) << to) - 1;
+  uint64_t below_from = from >= 64 ? ~uint64_t(0) : (uint64_t(1) << from) - 1;
+  return below_to & ~below_from;
+}
+
+// Bit i is the xor of bits [0, i], set from an opening quote up to but not including its closing one
+constexpr uint64_t prefixXor(uint64_t bits) {
+  for (size_t shift = 1; shift < 64; shift *= 2) bits ^= bits << shift;
+  return bits;
+}
+
+// pshufb indices moving the set bytes of an 8 byte group to its front
+constexpr std::array<uint64_t, 256> pack_table = [] {
+  std::array<uint64_t, 256> table{};
+  for (size_t mask = 0; mask < 256; mask++) {
+    uint64_t indices = 0x8080808080808080;
+    size_t out       = 0;
+    for (size_t i = 0; i < 8; i++) {
+      if (!(mask & (1 << i))) continue;
+      indices &= ~(uint64_t(0xFF) << (out * 8));
+      indices |= uint64_t(i) << (out * 8);
+      out++;
+    }
+    table[mask] = indices;
+  }
+  return table;
+}();
+
+// pshufb table of a byte class whose members all differ in their low nibble. A byte is in the class
+// when the entry for its low nibble is the byte itself. Unused entries hold 0x80, which no byte
+// matches since pshufb looks up 0 for bytes from 0x80 up
+consteval std::array<uint8_t, 16> nibbleTable(std::string_view members) {
+  std::array<uint8_t, 16> table;
+  table.fill(0x80);
+  for (char c : members) table[uint8_t(c) & 0xF] = uint8_t(c);
+  return table;
+}
+
+constexpr auto ws_table      = nibbleTable(" \t\n\r\f");
+constexpr auto newline_table = nibbleTable("\n\r\f");
+constexpr auto special_table = nibbleTable("\"'\\/*");
+
+// Bit of each special byte by its low nibble, the bits are moved up to the sign bit one at a time
+constexpr auto kind_table = [] {
+  std::array<uint8_t, 16> table{};
+  table['"' & 0xF]  = 0x80;
+  table['\'' & 0xF] = 0x40;
+  table['\\' & 0xF] = 0x20;
+  table['/' & 0xF]  = 0x10;
+  table['*' & 0xF]  = 0x08;
+  return table;
+}();
+
+inline __m256i broadcastTable(const std::array<uint8_t, 16> &table) {
+  return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table.data()));
+}
+
+inline uint32_t classBits(__m256i chunk, __m256i table) {
+  return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_shuffle_epi8(table, chunk), chunk)));
+}
+
+// Byte mask with 0xFF for every set bit of the 32 bit mask
+inline __m256i expandBits(uint32_t bits) {
+  const __m256i select = _mm256_set1_epi64x(int64_t(0x8040201008040201));
+  const __m256i spread = _mm256_setr_epi64x(0, 0x0101010101010101, 0x0202020202020202, 0x0303030303030303);
+  __m256i v            = _mm256_shuffle_epi8(_mm256_set1_epi32(int(bits)), spread);
+  return _mm256_cmpeq_epi8(_mm256_and_si256(v, select), select);
+}
+
+// Left packs the kept bytes of the four 8 byte groups with a single shuffle and stores them back to back
+inline uint8_t *packStore(__m256i v, uint32_t keep, uint8_t *out) {
+  const int64_t next = 0x0808080808080808;
+  __m256i shuffle    = _mm256_setr_epi64x(int64_t(pack_table[keep & 0xFF]),
+    int64_t(pack_table[(keep >> 8) & 0xFF]) + next,
+    int64_t(pack_table[(keep >> 16) & 0xFF]),
+    int64_t(pack_table[keep >> 24]) + next);
+  __m256i packed     = _mm256_shuffle_epi8(v, shuffle);
+  __m128i lo         = _mm256_castsi256_si128(packed);
+  __m128i hi         = _mm256_extracti128_si256(packed, 1);
+  _mm_storel_epi64((__m128i *)out, lo);
+  out += std::popcount(keep & 0xFF);
+  _mm_storel_epi64((__m128i *)out, _mm_unpackhi_epi64(lo, lo));
+  out += std::popcount((keep >> 8) & 0xFF);
+  _mm_storel_epi64((__m128i *)out, hi);
+  out += std::popcount((keep >> 16) & 0xFF);
+  _mm_storel_epi64((__m128i *)out, _mm_unpackhi_epi64(hi, hi));
+  return out + std::popcount(keep >> 24);
+}
+
+}  // namespace
+
+void CssScanState::resolve(const uint8_t *in,
+  size_t bytes,
+  size_t base,
+  uint64_t structural,
+  uint64_t newlines,
+  uint64_t &protect,
+  uint64_t &drop,
+  uint64_t &bounds) {
+  protect      = 0;
+  drop         = 0;
+  bounds       = 0;
+  size_t start = 0;  // Where the current region began in this block
+
+  if (drop_carry) {
+    drop |= 1;
+    structural &= ~uint64_t(1);
+    start      = 1;
+    drop_carry = false;
+  }
+  if (escape_carry) {
+    if (region == Normal) protect |= escape_carry;
+    structural &= ~uint64_t(escape_carry);
+    newlines &= ~uint64_t(escape_carry);
+    escape_carry = 0;
+  }
+
+  auto at      = [&](size_t p) -> uint8_t { return base + p < bytes ? in[base + p] : 0; };
+  auto strings = [&] { return region == DoubleQuoted || region == SingleQuoted; };
+  // Inside strings a backslash before "\r\n" escapes both, CSS reads the pair as a single newline
+  auto escapes = [&](size_t p) {
+    size_t end    = p + (strings() && at(p + 1) == '\r' && at(p + 2) == '\n' ? 3 : 2);
+    uint64_t bits = bitRange(p + 1, end);
+    structural &= ~bits;
+    newlines &= ~bits;
+    if (end > block_bytes) escape_carry = uint8_t(bitRange(0, end - block_bytes));
+  };
+
+  // Newlines only matter inside strings, where an unescaped one ends the string
+  for (uint64_t events; (events = structural | (strings() ? newlines : 0)) != 0;) {
+    size_t p  = std::countr_zero(events);
+    uint8_t c = in[base + p];
+    structural &= ~bitRange(0, p + 1);
+    newlines &= ~bitRange(0, p + 1);
+
+    switch (region) {
+    case Normal:
+      if (c == '\\') {
+        // An escaped byte outside of strings is literal, an escaped space must not be collapsed
+        protect |= uint64_t(3) << p;
+        escapes(p);
+      } else if (c == '"' || c == '\'') {
+        bounds |= uint64_t(1) << p;
+        start  = p;
+        region = c == '"' ? DoubleQuoted : SingleQuoted;
+      } else if (c == '/' && at(p + 1) == '*') {
+        start       = p;
+        region      = Comment;
+        comment_end = base + p + 2;
+      }
+      break;
+    case DoubleQuoted:
+    case SingleQuoted:
+      if (c == '\\') {
+        escapes(p);
+      } else if (c == '\n' || c == '\r' || c == '\f') {
+        // Bad string, it ends before the newline which is whitespace again
+        protect |= bitRange(start, p);
+        bounds |= uint64_t(1) << p;
+        start  = p;
+        region = Normal;
+      } else if (c == (region == DoubleQuoted ? '"' : '\'')) {
+        protect |= bitRange(start, p + 1);
+        bounds |= uint64_t(1) << p;
+        start  = p + 1;
+        region = Normal;
+      }
+      break;
+    case Comment:
+      if (c == '*' && base + p >= comment_end && at(p + 1) == '/') {
+        drop |= bitRange(start, p + 2);
+        if (p == block_bytes - 1) drop_carry = true;
+        else structural &= ~(uint64_t(2) << p);
+        start  = p + 2;
+        region = Normal;
+      }
+      break;
+    }
+  }
+
+  if (strings()) protect |= bitRange(start, block_bytes);
+  else if (region == Comment) drop |= bitRange(start, block_bytes);
+}
+
+namespace {
+
+// One classified block, every mask is limited to the bytes of the input
+struct ScannedBlock {
+  const uint8_t *block;  // Start of the block in the input, or the zero padded tail copy
+  uint64_t valid;
+  uint64_t ws;
+  uint64_t protect;
+  uint64_t drop;
+  uint64_t bounds;
+};
+
+// Loads are unaligned so the scan runs straight on caller memory. The last partial block is copied
+// into tail so the chunk loads never read past the input. Forced inline, the minifier loses ~8% otherwise
+[[gnu::always_inline]] inline ScannedBlock scanBlock(const uint8_t *in,
+  size_t bytes,
+  size_t base,
+  CssScanState &state,
+  uint8_t *tail) {
+  const uint8_t *block = in + base;
+  if (base + block_bytes > bytes) {
+    std::memset(tail, 0, block_bytes);
+    std::memcpy(tail, block, bytes - base);
+    block = tail;
+  }
+
+  // Table lookups classify a chunk, a compare per byte value is twice the work
+  const __m256i ws_lookup      = broadcastTable(ws_table);
+  const __m256i newline_lookup = broadcastTable(newline_table);
+  const __m256i special_lookup = broadcastTable(special_table);
+  const __m256i kind_lookup    = broadcastTable(kind_table);
+  uint64_t dquote = 0;
+  uint64_t squote = 0;
+  uint64_t bsl    = 0;
+  uint64_t slash  = 0;
+  uint64_t star   = 0;
+  uint64_t ws     = 0;
+  uint64_t nl     = 0;
+  for (size_t c = 0; c < chunks_per_block; c++) {
+    __m256i chunk   = _mm256_loadu_si256((const __m256i *)(block + c * chunk_bytes));
+    __m256i special = _mm256_cmpeq_epi8(_mm256_shuffle_epi8(special_lookup, chunk), chunk);
+    __m256i kind    = _mm256_and_si256(_mm256_shuffle_epi8(kind_lookup, chunk), special);
+
+    size_t shift = c * chunk_bytes;
+    nl |= uint64_t(classBits(chunk, newline_lookup)) << shift;
+    ws |= uint64_t(classBits(chunk, ws_lookup)) << shift;
+    dquote |= uint64_t(uint32_t(_mm256_movemask_epi8(kind))) << shift;
+    squote |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_slli_epi16(kind, 1)))) << shift;
+    bsl |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_slli_epi16(kind, 2)))) << shift;
+    slash |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_slli_epi16(kind, 3)))) << shift;
+    star |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_slli_epi16(kind, 4)))) << shift;
+  }
+
+  // Only "/*" and "*/" pairs matter, a lone '/' or '*' never changes the region
+  uint64_t valid      = bitRange(0, bytes - base);
+  uint8_t next_byte   = base + block_bytes < bytes ? in[base + block_bytes] : 0;
+  uint64_t next_star  = (star >> 1) | (uint64_t(next_byte == '*') << 63);
+  uint64_t next_slash = (slash >> 1) | (uint64_t(next_byte == '/') << 63);
+  uint64_t comments   = (slash & next_star) | (star & next_slash);
+  uint64_t structural = (dquote | squote | bsl | comments) & valid;
+
+  ScannedBlock scanned{ block, valid, ws, 0, 0, 0 };
+  bool simple = bsl == 0 && comments == 0 && !state.drop_carry && !state.escape_carry;
+  if (simple && state.region != CssScanState::Comment && (dquote == 0 || squote == 0)) {
+    // One kind of quote and nothing else, the string bytes are a prefix xor of the quotes. This is
+    // also the path of plain declarations outside of strings and comments
+    uint64_t quotes  = (dquote | squote) & valid;
+    bool inside      = state.region != CssScanState::Normal;
+    uint64_t strings = ((prefixXor(quotes) ^ (inside ? ~uint64_t(0) : 0)) | quotes) & valid;
+    // A newline inside a string ends it, the walk handles that and the other kind of quote
+    bool mismatched = quotes != 0 && inside && (state.region == CssScanState::DoubleQuoted) != (dquote != 0);
+    if (mismatched || (strings & nl) != 0) {
+      state.resolve(in, bytes, base, structural, nl & valid, scanned.protect, scanned.drop, scanned.bounds);
+    } else {
+      scanned.protect = strings;
+      scanned.bounds  = quotes;
+      if (std::popcount(quotes) % 2 == 1)
+        state.region = inside ? CssScanState::Normal
+                              : (dquote != 0 ? CssScanState::DoubleQuoted : CssScanState::SingleQuoted);
+    }
+  } else {
+    state.resolve(in, bytes, base, structural, nl & valid, scanned.protect, scanned.drop, scanned.bounds);
+  }
+  return scanned;
+}
+
+}  // namespace
+
+size_t minifyCss(const uint8_t *in, size_t bytes, uint8_t *out) {
+  uint8_t *begin = out;
+  CssScanState state;
+
+  const __m256i spaces = _mm256_set1_epi8(' ');
+  alignas(u8simd) std::array<uint8_t, block_bytes> tail{};
+
+  for (size_t base = 0; base < bytes; base += block_bytes) {
+    ScannedBlock scanned = scanBlock(in, bytes, base, state, tail.data());
+    const uint8_t *block = scanned.block;
+    uint64_t valid       = scanned.valid;
+
+    // Comments count as whitespace so "a/**/b" keeps a separator, only the first byte of a run stays
+    uint64_t sep    = ((scanned.ws & ~scanned.protect) | scanned.drop) & valid;
+    uint64_t keep   = ~(sep & ((sep << 1) | state.sep_carry)) & valid;
+    state.sep_carry = sep >> 63;
+
+    // Whole block kept, no need to touch it byte wise
+    if (keep == ~uint64_t(0) && sep == 0) {
+      std::memcpy(out, block, block_bytes);
+      out += block_bytes;
+      continue;
+    }
+    // No branches on the 8 byte groups, which of them need packing is as random as the input
+    for (size_t i = 0; i < block_bytes; i += chunk_bytes) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+      v         = _mm256_blendv_epi8(v, spaces, expandBits(uint32_t(sep >> i)));
+      out       = packStore(v, uint32_t(keep >> i), out);
+    }
+  }
+  return out - begin;
+}
+
+size_t minifyCss(u8simd_sv data, size_t bytes, uint8_t *out) {
+  bytes = std::min(bytes, data.size() * u8simd::size());
+  return minifyCss(reinterpret_cast<const uint8_t *>(data.data()), bytes, out);
+}
+
+u8string minifyCss(u8simd_sv data, size_t bytes) {
+  u8string out(bytes + minify_padding, uint8_t(0));
+  out.resize(minifyCss(data, bytes, out.data()));
+  return out;
+}
+
+size_t indexCssStrings(const uint8_t *in, size_t bytes, CssStringSpan *spans, size_t capacity) {
+  CssScanState state;
+  alignas(u8simd) std::array<uint8_t, block_bytes> tail{};
+  size_t count = 0;
+  size_t start = 0;
+
+  // Opening and closing quotes alternate, the region before the block tells which one comes first
+  for (size_t base = 0; base < bytes; base += block_bytes) {
+    bool inside          = state.region == CssScanState::DoubleQuoted || state.region == CssScanState::SingleQuoted;
+    ScannedBlock scanned = scanBlock(in, bytes, base, state, tail.data());
+
+    for (uint64_t bounds = scanned.bounds; bounds != 0; bounds &= bounds - 1) {
+      size_t p = base + std::countr_zero(bounds);
+      if (!inside) {
+        start = p;
+      } else {
+        // Closed by its quote, or by a newline which isn't part of the bad string
+        size_t end = in[p] == '"' || in[p] == '\'' ? p + 1 : p;
+        if (count < capacity) spans[count] = { start, end };
+        count++;
+      }
+      inside = !inside;
+    }
+  }
+
+  // String still open at the end of the input, CSS ends it there
+  if (state.region == CssScanState::DoubleQuoted || state.region == CssScanState::SingleQuoted) {
+    if (count < capacity) spans[count] = { start, bytes };
+    count++;
+  }
+  return count;
+}
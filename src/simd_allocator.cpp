@@ -0,0 +1,54 @@
+#include "simd_allocator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <sys/mman.h>
+
+static std::atomic<HugePages> huge_page_policy = HugePages::Transparent;
+
+void setHugePagePolicy(HugePages policy) { huge_page_policy = policy; }
+HugePages hugePagePolicy() { return huge_page_policy; }
+
+static size_t mappingSize(size_t bytes) { return (bytes + huge_page_size - 1) / huge_page_size * huge_page_size; }
+
+// Over maps by a huge page and trims both ends so the mapping starts on a 2M boundary, otherwise the
+// kernel can't back the first and last pages with transparent huge pages
+static void *mapAligned(size_t size) {
+  void *raw = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) return nullptr;
+
+  auto start   = reinterpret_cast<uintptr_t>(raw);
+  auto aligned = (start + huge_page_size - 1) / huge_page_size * huge_page_size;
+  if (aligned > start) munmap(raw, aligned - start);
+  if (size_t tail = start + size + huge_page_size - (aligned + size)) munmap(reinterpret_cast<void *>(aligned + size), tail);
+  return reinterpret_cast<void *>(aligned);
+}
+
+void *allocateSimd(size_t bytes, size_t alignment) {
+  alignment = std::max(alignment, alignof(std::max_align_t));
+  if (bytes < huge_page_size) return ::operator new(bytes, std::align_val_t(alignment));
+
+  // Every large allocation is a mapping whatever the policy, so deallocate doesn't need to know it
+  size_t size = mappingSize(bytes);
+  auto policy = hugePagePolicy();
+
+  if (policy == HugePages::Explicit) {
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) return ptr;
+  }
+
+  void *ptr = mapAligned(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+  // Failure only means 4K pages, e.g. THP disabled
+  if (policy != HugePages::None) madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+  return ptr;
+}
+
+void deallocateSimd(void *ptr, size_t bytes, size_t alignment) {
+  alignment = std::max(alignment, alignof(std::max_align_t));
+  if (bytes < huge_page_size) return ::operator delete(ptr, std::align_val_t(alignment));
+  munmap(ptr, mappingSize(bytes));
+}
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
@@ -7,7 +10,9 @@
 #include <ranges>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <uchar.h>
+#include <simd_matcher.hpp>
 #include <utf8_skip.hpp>
 
 template<typename T, typename... Args>
@@ -197,14 +202,6 @@ std::optional<size_t> matchCssString(const u8string &str) {
 
 //! ---------------------------- Helpers Simd -------------------------------------------------
 
-const u8simd chunk_bsls    = uint8_t('\\');
-const u8simd chunk_newline = uint8_t('\n');
-
-struct SimdOffset {
-  int64_t index;
-  int offset;
-};
-
 std::vector<u8simd_str> readAlignedFileLines(const std::string &path) {
   std::ifstream file(path, std::ios::binary);
   if (!file.is_open()) { throw std::runtime_error("Failed to open file"); }
@@ -234,155 +231,63 @@ std::vector<u8simd_str> readAlignedFileLines(const std::string &path) {
   return aligned_lines;
 }
 
-struct SimdMatcher {
-  struct ChunkOverflow1 {
-    u8simd o1;
-    void set(u8simd &chunk) { o1 = shiftElementLeft<u8simd::size() - 1>(chunk); }
-  };
-  struct ChunkOverflow2 : ChunkOverflow1 {
-    u8simd o2;
-    void set(u8simd &chunk) {
-      o2 = shiftElementLeft<u8simd::size() - 2>(chunk);
-      ChunkOverflow1::set(chunk);
-    }
-  };
-  struct ChunkOverflow3 : ChunkOverflow2 {
-    u8simd o3;
-    void set(u8simd &chunk) {
-      o3 = shiftElementLeft<u8simd::size() - 3>(chunk);
-      ChunkOverflow2::set(chunk);
+// Glues the words of the file into small quoted documents of roughly target bytes. Quotes in the
+// words are escaped and every 8th word is quoted as \"word\", so the scans have to skip escapes
+std::vector<u8simd_str> makeSmallDocs(const std::vector<u8string> &lines, size_t target) {
+  std::vector<u8simd_str> docs;
+  std::string doc = "\"";
+  size_t words    = 0;
+  for (auto &line : lines) {
+    bool quoted = ++words % 8 == 0;
+    if (quoted) doc += "\\\"";
+    for (auto byte : line) {
+      if (byte == '\\') continue;
+      if (byte == '"') doc.push_back('\\');
+      doc.push_back(char(byte));
     }
-  };
-
-  u8mask maskUtf8Chunk(u8simd &chunk) {
-    auto chunk_s1 = shiftElementRight<1>(chunk);
-    auto chunk_s2 = shiftElementRight<2>(chunk);
-    auto chunk_s3 = shiftElementRight<3>(chunk);
-
-    constexpr auto size = sizeof(u8simd::value_type);
-    // Identify lead chunks of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
-    u8mask mask = chunk >= 0xC0;  // Mark lead byte
-    mask |= chunk_s1 >= 0xC0;  // Mark 2nd byte
-    mask |= chunk_s2 >= 0xE0;  // Mark 3rd byte
-    mask |= chunk_s3 >= 0xF0;  // Mark 4th byte
-    return mask;
-  }
-
-  u8mask maskUtf8AndEscChunk(u8simd &chunk) {
-    auto chunk_s1 = shiftElementRight<1>(chunk);
-    auto chunk_s2 = shiftElementRight<2>(chunk);
-    auto chunk_s3 = shiftElementRight<3>(chunk);
-
-    constexpr auto size = sizeof(u8simd::value_type);
-    // Identify lead chunks of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
-    u8mask mask = chunk >= 0xC0;  // Mark lead byte
-    mask |= chunk_s1 >= 0xC0;  // Mark 2nd byte
-    mask |= chunk_s1 == chunk_bsls;  // Mask Escape byte letters
-    mask |= chunk_s2 >= 0xE0;  // Mark 3rd byte
-    mask |= chunk_s3 >= 0xF0;  // Mark 4th byte
-    return mask;
-  }
-  u8mask maskUtf8ChunkSafe(u8simd &chunk, ChunkOverflow3 &overflow) {
-    auto chunk_sr1 = shiftElementRight<1>(chunk);
-    auto chunk_sr2 = shiftElementRight<2>(chunk);
-    auto chunk_sr3 = shiftElementRight<3>(chunk);
-
-    // Take care of overflow
-    chunk_sr1 |= overflow.o1;
-    chunk_sr2 |= overflow.o2;
-    chunk_sr3 |= overflow.o3;
-
-    constexpr auto size = sizeof(u8simd::value_type);
-    // Identify lead bytes of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
-    u8mask mask = chunk >= 0xC0;  // Mark lead byte
-    mask |= chunk_sr1 >= 0xC0;  // Mark 2nd byte
-    mask |= chunk_sr2 >= 0xE0;  // Mark 3rd byte
-    mask |= chunk_sr3 >= 0xF0;  // Mark 4th byte
-    return mask;
-  }
+    if (quoted) doc += "\\\"";
+    doc.push_back(' ');
+    if (doc.size() < target) continue;
+    doc.push_back('"');
+    doc.resize(accomodateBytes(doc.size()) * u8simd::size(), '\0');
 
-
-  u8mask maskUtf8AndEscChunkSafe(u8simd &chunk, ChunkOverflow3 &overflow) {
-    auto chunk_sr1 = shiftElementRight<1>(chunk);
-    auto chunk_sr2 = shiftElementRight<2>(chunk);
-    auto chunk_sr3 = shiftElementRight<3>(chunk);
-
-    // Take care of overflow
-    chunk_sr1 |= overflow.o1;
-    chunk_sr2 |= overflow.o2;
-    chunk_sr3 |= overflow.o3;
-
-    constexpr auto size = sizeof(u8simd::value_type);
-    // Identify lead bytes of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
-    u8mask mask = chunk >= 0xC0;  // Mark lead byte
-    mask |= chunk_sr1 >= 0xC0;  // Mark 2nd byte
-    mask |= chunk_sr1 == chunk_bsls;  // Check for escape adn mask it
-    mask |= chunk_sr2 >= 0xE0;  // Mark 3rd byte
-    mask |= chunk_sr3 >= 0xF0;  // Mark 4th byte
-    return mask;
-  }
-  u8mask maskEscCharChunk(u8simd &chunk) {
-    const auto chunk_sr1 = shiftElementRight<1>(chunk);
-    const u8simd cmp     = chunk_bsls;
-
-    // u8mask mask = chunk == cmp;
-    u8mask mask = chunk_sr1 == cmp;
-    return mask;
+    u8simd_str simd_chunks;
+    for (size_t i = 0; i < doc.size(); i += u8simd::size())
+      simd_chunks.push_back(u8simd(reinterpret_cast<const uint8_t *>(&doc[i]), stdx::element_aligned));
+    docs.push_back(std::move(simd_chunks));
+    doc.assign(1, '"');
   }
+  return docs;
+}
 
-  u8mask maskEscCharChunkSafe(u8simd &chunk, ChunkOverflow1 &overflow) {
-    auto chunk_sr1   = shiftElementRight<1>(chunk);
-    const u8simd cmp = chunk_bsls;
-
-    chunk_sr1 |= overflow.o1;
-
-    // I mean, we can skip this :P
-    // u8mask mask = chunk == cmp;
-    u8mask mask = chunk_sr1 == cmp;
-    return mask;
+// Runs matchStrings over the docs in groups of N and reports the throughput
+template<size_t N>
+void measureInterleaved(SimdMatcher &simd_matcher, std::vector<u8simd_str> &docs, int n) {
+  size_t groups = docs.size() / N;
+  std::vector<std::array<u8simd_str *, N>> batches(groups);
+  for (size_t g = 0; g < groups; g++)
+    for (size_t d = 0; d < N; d++) batches[g][d] = &docs[g * N + d];
+
+  size_t mismatches = 0;
+  for (auto &batch : batches) {
+    auto results = simd_matcher.matchStrings<N>(batch, '\"');
+    for (size_t d = 0; d < N; d++) {
+      auto expected = simd_matcher.matchString(*batch[d], '\"');
+      if (results[d].index != expected.index || results[d].offset != expected.offset) mismatches++;
+    }
   }
 
+  int64_t sink = 0;
+  auto start   = std::chrono::high_resolution_clock::now();
+  for (auto x = 0; x < n; x++)
+    for (auto &batch : batches)
+      for (auto &res : simd_matcher.matchStrings<N>(batch, '\"')) sink += res.index + res.offset;
+  auto end = std::chrono::high_resolution_clock::now();
 
-  SimdOffset matchString(u8simd_str &str, char8_t type, uint32_t offset = 0, uint32_t init_chunk_idx = 0) {
-    namespace stdr  = std::ranges;
-    namespace stdrv = stdr::views;
-    if (str.size() <= offset) return { offset, -1 };
-    ChunkOverflow3 chunk_overflow{};
-
-    auto first_mask = str[offset] == type;
-    // set only the bytes which aren't utf8 and escape chars
-    first_mask &= !maskUtf8AndEscChunk(str[offset]);
-
-    auto quote_count = stdx::popcount(first_mask);
-    if (quote_count == 0) return { offset, -1 };
-    // I think we can afford this for the sake of per u8simd alignment
-    int index = stdx::find_last_set(first_mask);
-
-    auto index_valid_early_ret = quote_count > 1 && index > init_chunk_idx;
-    if (index_valid_early_ret || str.size() == 1) return { offset, index };
-
-    chunk_overflow.set(str[offset]);
-    u8simd quote = str[offset][index];
-    auto x       = 0u;
-
-    for (u8simd chunk : str | stdrv::drop(offset + 1)) {
-      auto utf8_mask = maskUtf8AndEscChunkSafe(chunk, chunk_overflow);
-      // auto esc_mask  = maskEscCharChunkSafe(chunk, chunk_overflow);
-      // If we found the quote in the chunk
-      auto end_quote_mask       = chunk == quote;
-      auto valid_end_quote_mask = end_quote_mask && !utf8_mask;
-
-      if (stdx::any_of(end_quote_mask)) {
-        auto index = stdx::find_first_set(end_quote_mask);
-        return { x, index };
-      }
-      // Reassign overflow buffer
-      chunk_overflow.set(chunk);
-      x++;
-    }
-    return { offset, -1 };
-  }
-};
+  std::chrono::duration<double, std::milli> duration = (end - start) / n;
+  std::cout << "Interleaved x" << N << ": " << duration.count() << " ms, " << double(groups * N) / duration.count()
+            << " docs/ms, mismatches: " << mismatches << " (" << sink << ")" << std::endl;
+}
 
 int main() {
   std::string filename = "random_words.txt";
@@ -412,5 +317,18 @@ int main() {
   // std::cout << "\nOutputs : " << '\n';
   // for (auto &offset : vec | std::ranges::views::take(50)) { std::cout << offset.index << ":" << offset.offset << " "; }
   std::cout << "Time taken in " << "Simd" << " version: " << duration.count() << " ms" << std::endl;
+
+  // Few hundred byte documents, where a single scan is mostly loop overhead
+  auto small_docs = makeSmallDocs(lines, 300);
+  if (small_docs.empty()) {
+    std::cout << "\nNo small documents, " << filename << " has no words" << std::endl;
+    return 0;
+  }
+  for (auto copy = small_docs; small_docs.size() < 2048;) small_docs.insert(small_docs.end(), copy.begin(), copy.end());
+  std::cout << "\nSmall documents: " << small_docs.size() << '\n';
+  measureInterleaved<1>(simd_matcher, small_docs, n);
+  measureInterleaved<2>(simd_matcher, small_docs, n);
+  measureInterleaved<3>(simd_matcher, small_docs, n);
+  measureInterleaved<4>(simd_matcher, small_docs, n);
   return 0;
 }
@@ -1,7 +1,14 @@
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <unistd.h>
 
+#include "block_reader.hpp"
+#include "css_minify.hpp"
+#include "utf8_index.hpp"
 #include "utf8_skip.hpp"
 // Data to generate masks from
 u8simd_str stringToSimd(const std::string &string) {
@@ -25,7 +32,7 @@ u8simd_str readAlignedFile(std::string path) {
   return buffer;
 }
 
-void printMask(std::vector<u8mask> &masks, size_t max) {
+void printMask(u8mask_vec &masks, size_t max) {
   std::cout << "\nOutput Mask : " << '\n';
   auto max_itr = std::min(max, masks.size());
   for (uint i = 0; i < max_itr; i++) {
@@ -34,7 +41,7 @@ void printMask(std::vector<u8mask> &masks, size_t max) {
   }
 }
 
-void printMaskMap(std::vector<u8mask> &masks, std::string &utf8_str, size_t max) {
+void printMaskMap(u8mask_vec &masks, std::string &utf8_str, size_t max) {
   std::cout << "\n" << "Input to out map : \n";
 
   uint s        = 0;
@@ -80,7 +87,251 @@ void file_test() {
   // printMaskMap(masks, content);
 }
 
-int main() {
+// Compares the marked bits, a pipeline delivering blocks out of order or dropping the overflow
+// carried between them would still produce the right number of masks
+bool sameMasks(const u8mask_vec &a, const u8mask_vec &b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); i++)
+    if (maskBits(a[i]) != maskBits(b[i])) return false;
+  return true;
+}
+
+// Drops the file from the page cache, otherwise every run after the first reads it from memory
+void evictFromPageCache(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Whole file read followed by a scan against the block pipeline where both overlap. Every read starts
+// from a cold page cache, the pipeline should come close to max(read only, mark only)
+void pipeline_test() {
+  std::string filename = "big.txt";
+
+  evictFromPageCache(filename);
+  auto start = std::chrono::high_resolution_clock::now();
+  readBlocks(filename, [](u8simd_sv, size_t, size_t) {});
+  auto end                                           = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> duration = (end - start);
+  double read_ms                                     = duration.count();
+
+  u8simd_str file = readAlignedFile(filename);
+  start           = std::chrono::high_resolution_clock::now();
+  auto masks      = mark_utf8_bytes2(file);
+  end             = std::chrono::high_resolution_clock::now();
+  duration        = (end - start);
+  std::cout << "Read only (cold) : " << read_ms << " ms, mark only : " << duration.count() << " ms" << std::endl;
+
+  evictFromPageCache(filename);
+  start    = std::chrono::high_resolution_clock::now();
+  file     = readAlignedFile(filename);
+  masks    = mark_utf8_bytes2(file);
+  end      = std::chrono::high_resolution_clock::now();
+  duration = (end - start);
+  std::cout << "Read then mark (cold) : " << duration.count() << " ms" << std::endl;
+
+  for (size_t block_size : { 64 << 10, 256 << 10, 1 << 20, 4 << 20 }) {
+    for (uint32_t depth : { 2, 4, 8 }) {
+      evictFromPageCache(filename);
+      start          = std::chrono::high_resolution_clock::now();
+      auto pipelined = mark_utf8_file(filename, { .block_size = block_size, .depth = depth });
+      end            = std::chrono::high_resolution_clock::now();
+      duration       = (end - start);
+      std::cout << "Pipelined block " << (block_size >> 10) << "K depth " << depth << " (cold) : " << duration.count()
+                << " ms" << (sameMasks(pipelined, masks) ? "" : " mask mismatch") << std::endl;
+    }
+  }
+}
+
+// Code point <-> byte offset lookups through the rank index
+void index_test() {
+  std::string filename = "big.txt";
+  u8simd_str file      = readAlignedFile(filename);
+  size_t bytes         = std::filesystem::file_size(filename);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  Utf8RankIndex index(file, bytes);
+  auto end = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double, std::milli> duration = (end - start);
+  size_t overhead = index.blocks.size() * sizeof(uint16_t) + index.superblocks.size() * sizeof(uint64_t)
+                  + index.samples.size() * sizeof(size_t);
+  std::cout << "Rank index build : " << duration.count() << " ms, " << index.codePoints() << " code points, "
+            << 100.0 * double(overhead) / double(bytes) << "% overhead" << std::endl;
+
+  // Every code point start has to come back unchanged, other bytes go to the start of their code point
+  size_t wrong = 0;
+  for (size_t x = 0; x < bytes; x++) {
+    bool start = (index.blockBits(x / Utf8RankIndex::block_bytes) >> (x % Utf8RankIndex::block_bytes)) & 1;
+    if (start && index.toByteOffset(index.toCodePoint(x)) != x) wrong++;
+  }
+  std::cout << "Round trip check : " << wrong << " wrong" << std::endl;
+
+  const size_t n = 1'000'000;
+  size_t sink    = 0;
+  start          = std::chrono::high_resolution_clock::now();
+  for (size_t x = 0; x < n; x++) sink += index.toByteOffset(index.toCodePoint((x * 7919) % bytes));
+  end      = std::chrono::high_resolution_clock::now();
+  duration = (end - start);
+  std::cout << "Round trip lookup : " << duration.count() * 1e6 / n << " ns (" << sink << ")" << std::endl;
+
+  Utf8LineIndex lines;
+  start      = std::chrono::high_resolution_clock::now();
+  auto masks = mark_utf8_bytes2(file, lines);
+  end        = std::chrono::high_resolution_clock::now();
+  duration   = (end - start);
+  overhead = lines.newlines.size() * sizeof(uint64_t) + lines.lines.size() * sizeof(uint16_t)
+           + lines.superblocks.size() * sizeof(uint64_t);
+  std::cout << "Mark with line index : " << duration.count() << " ms, " << lines.lineCount() << " lines, "
+            << 100.0 * double(overhead) / double(bytes) << "% overhead" << std::endl;
+
+  start = std::chrono::high_resolution_clock::now();
+  for (size_t x = 0; x < n; x++) {
+    auto pos = lines.position((x * 7919) % bytes, index);
+    sink += pos.line + pos.column;
+  }
+  end      = std::chrono::high_resolution_clock::now();
+  duration = (end - start);
+  std::cout << "Line:col lookup : " << duration.count() * 1e6 / n << " ns (" << sink << ")" << std::endl;
+}
+
+// GB/s of the cached and the streaming marking modes on generated inputs growing past the LLC. Sizes
+// which don't fit in the available memory are skipped instead of running into the OOM killer
+void streaming_test(size_t max_bytes = size_t(1) << 30) {
+  const std::string sample = "Hello, (update 2) 世界! meow 🐱. \n This 'thing' has overflow 🐮 issues ";
+  const size_t available   = size_t(sysconf(_SC_AVPHYS_PAGES)) * size_t(sysconf(_SC_PAGESIZE));
+
+  for (size_t bytes = size_t(1) << 20; bytes <= max_bytes; bytes *= 4) {
+    std::cout << "Input " << (bytes >> 20) << " MB :";
+    // The input plus the masks of one run, a mask is as large as the chunk it marks
+    if (2 * bytes > available) {
+      std::cout << " skipped, needs " << (2 * bytes >> 20) << " MB with " << (available >> 20) << " MB available"
+                << std::endl;
+      break;
+    }
+
+    try {
+      u8simd_str data(accomodateBytes(bytes), u8simd{});
+      auto *dst = reinterpret_cast<char *>(data.data());
+      for (size_t i = 0; i < bytes; i += sample.size()) sample.copy(dst + i, std::min(sample.size(), bytes - i));
+
+      for (auto mode : { MarkMode::Cached, MarkMode::Streaming }) {
+        // Repeat small inputs so every size runs for a similar amount of time
+        size_t n   = std::max<size_t>(1, (size_t(1) << 30) / bytes);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t x = 0; x < n; x++) mark_utf8_bytes2(data, 0, mode);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        std::chrono::duration<double> duration = (end - start) / n;
+        std::cout << (mode == MarkMode::Cached ? " cached " : " streaming ") << double(bytes) / duration.count() / 1e9
+                  << " GB/s";
+      }
+      std::cout << std::endl;
+    } catch (const std::bad_alloc &) {
+      std::cout << " skipped, out of memory" << std::endl;
+      break;
+    }
+  }
+}
+
+// Minification GB/s on a generated stylesheet
+void minify_test() {
+  const std::string rule = "/* Card */\n.card  >  .title::after {\n  content: \"  \\\"→\\\"  \";\n"
+                           "  font-family:  'Fira  Sans', sans-serif;\n\tmargin : 0  auto ; /* center */\n}\n\n";
+  size_t bytes = size_t(64) << 20;
+  std::string css;
+  css.reserve(bytes + rule.size());
+  while (css.size() < bytes) css += rule;
+  bytes = css.size();
+
+  u8simd_str data(accomodateBytes(bytes), u8simd{});
+  css.copy(reinterpret_cast<char *>(data.data()), bytes);
+  u8string out(bytes + minify_padding, uint8_t(0));
+
+  const int n     = 10;
+  size_t out_size = 0;
+  auto start      = std::chrono::high_resolution_clock::now();
+  for (auto x = 0; x < n; x++) out_size = minifyCss(data, bytes, out.data());
+  auto end = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double> duration = (end - start) / n;
+  std::cout << "Minify : " << double(bytes) / duration.count() / 1e9 << " GB/s, " << bytes << " -> " << out_size
+            << " bytes\n"
+            << std::string_view(reinterpret_cast<const char *>(out.data()), 2 * rule.size()) << std::endl;
+}
+
+// Backing the kernel actually gave the mapping holding ptr, the policy is only a request. hugetlb
+// when the mapping uses 2M kernel pages, otherwise the share of it on transparent huge pages
+std::string pageBacking(const void *ptr) {
+  std::ifstream smaps("/proc/self/smaps");
+  auto address = reinterpret_cast<uintptr_t>(ptr);
+  bool found   = false;
+  size_t rss = 0, anon_huge = 0, kernel_page = 0;
+
+  for (std::string line; std::getline(smaps, line);) {
+    unsigned long start = 0, end = 0;
+    if (std::sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2) {
+      if (found) break;
+      found = start <= address && address < end;
+      continue;
+    }
+    char field[64];
+    size_t kb = 0;
+    if (!found || std::sscanf(line.c_str(), "%63[^:]: %zu kB", field, &kb) != 2) continue;
+    if (std::string_view(field) == "Rss") rss = kb;
+    else if (std::string_view(field) == "AnonHugePages") anon_huge = kb;
+    else if (std::string_view(field) == "KernelPageSize") kernel_page = kb;
+  }
+
+  if (!found) return "unknown";
+  if (kernel_page >= (huge_page_size >> 10)) return "hugetlb";
+  if (anon_huge == 0) return "4K pages";
+  return "THP " + std::to_string(100 * anon_huge / std::max<size_t>(rss, 1)) + "%";
+}
+
+// Random rank lookups over a large buffer are bound by dTLB misses, compare the page backings. The
+// masks are faulted in before the timed passes so the mark numbers don't measure first touch
+void huge_page_test(size_t bytes = size_t(1) << 30) {
+  const std::string sample = "Hello, (update 2) 世界! meow 🐱. \n This 'thing' has overflow 🐮 issues ";
+
+  for (auto policy : { HugePages::None, HugePages::Transparent, HugePages::Explicit }) {
+    setHugePagePolicy(policy);
+    u8simd_str data(accomodateBytes(bytes), u8simd{});
+    auto *dst = reinterpret_cast<char *>(data.data());
+    for (size_t i = 0; i < bytes; i += sample.size()) sample.copy(dst + i, std::min(sample.size(), bytes - i));
+    u8mask_vec masks(data.size());
+
+    std::chrono::duration<double> mark = std::chrono::duration<double>::max();
+    for (int pass = 0; pass < 3; pass++) {
+      Utf8MarkState state;
+      auto start = std::chrono::high_resolution_clock::now();
+      mark_utf8_bytes2(data, masks.data(), state, MarkMode::Cached);
+      auto end = std::chrono::high_resolution_clock::now();
+      mark     = std::min<std::chrono::duration<double>>(mark, end - start);
+    }
+
+    Utf8RankIndex index(data, bytes);
+    const size_t n = 10'000'000;
+    size_t sink    = 0;
+    auto start     = std::chrono::high_resolution_clock::now();
+    for (size_t x = 0; x < n; x++) sink += index.toCodePoint((x * 2654435761u) % bytes);
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::nano> lookup = (end - start) / n;
+
+    const char *name = policy == HugePages::None          ? "None"
+                     : policy == HugePages::Transparent ? "Transparent"
+                                                        : "Explicit";
+    std::cout << name << " (data " << pageBacking(data.data()) << ", masks " << pageBacking(masks.data())
+              << ") : mark " << double(bytes) / mark.count() / 1e9 << " GB/s, random rank " << lookup.count()
+              << " ns (" << sink << ")" << std::endl;
+  }
+  setHugePagePolicy(HugePages::Transparent);
+}
+
+// Optional argument: largest input of streaming_test in MB, 1 GB by default
+int main(int argc, char **argv) {
   std::string utf8_str =
     "Hello, (update 2) 世界! meow 🐱. \n This 'thing' has overflow 🐮 issues";  // Example UTF-8 string
   u8simd_str data = stringToSimd(utf8_str);
@@ -96,7 +347,7 @@ int main() {
 
   auto start = std::chrono::high_resolution_clock::now();
 
-  std::vector<u8mask> masks = mark_utf8_bytes2(data);
+  u8mask_vec masks = mark_utf8_bytes2(data);
 
   auto end = std::chrono::high_resolution_clock::now();
 
@@ -106,6 +357,11 @@ int main() {
   printMaskMap(masks, utf8_str);
 
   file_test();
+  pipeline_test();
+  index_test();
+  streaming_test(argc > 1 ? size_t(std::stoull(argv[1])) << 20 : size_t(1) << 30);
+  minify_test();
+  huge_page_test();
 
   return 0;
 }
@@ -0,0 +1,151 @@
+#include "utf8_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <immintrin.h>
+
+static_assert(Utf8RankIndex::block_bytes % u8simd::size() == 0, "Block has to be made of whole chunks");
+
+Utf8RankIndex::Utf8RankIndex(u8simd_sv data, size_t bytes)
+    : data(data), bytes(std::min(bytes, data.size() * u8simd::size())) {
+  size_t block_count = (this->bytes + block_bytes - 1) / block_bytes;
+  blocks.resize(block_count);
+  superblocks.reserve(block_count / blocks_per_super + 1);
+  samples.reserve(this->bytes / select_sample + 1);
+
+  uint64_t total = 0;
+  for (size_t b = 0; b < block_count; b++) {
+    if (b % blocks_per_super == 0) superblocks.push_back(total);
+    blocks[b] = uint16_t(total - superblocks.back());
+    total += std::popcount(blockBits(b));
+    while (samples.size() * select_sample < total) samples.push_back(b);
+  }
+  code_points = total;
+}
+
+uint64_t Utf8RankIndex::blockBits(size_t block) const {
+  static constexpr size_t chunks_per_block = block_bytes / u8simd::size();
+  static const u8simd cont_bits            = uint8_t(0xC0);
+  static const u8simd cont_lead            = uint8_t(0x80);
+
+  uint64_t bits = 0;
+  size_t first  = block * chunks_per_block;
+  for (size_t c = 0; c < chunks_per_block && first + c < data.size(); c++) {
+    // Every byte but the continuation bytes (10xxxxxx). mark_utf8_bytes2 flags all bytes of a multi
+    // byte sequence instead, its masks can't tell where one sequence ends and the next starts
+    u8mask starts = (data[first + c] & cont_bits) != cont_lead;
+    bits |= maskBits(starts) << (c * u8simd::size());
+  }
+
+  // Drop the padding after the last byte
+  size_t end = block * block_bytes + block_bytes;
+  if (end > bytes) bits &= (uint64_t(1) << (block_bytes - (end - bytes))) - 1;
+  return bits;
+}
+
+size_t Utf8RankIndex::toCodePoint(size_t byte_offset) const {
+  if (byte_offset >= bytes) return code_points;
+  size_t block  = byte_offset / block_bytes;
+  uint64_t bits = blockBits(block) & ((uint64_t(1) << (byte_offset % block_bytes)) - 1);
+  return superblocks[block / blocks_per_super] + blocks[block] + std::popcount(bits);
+}
+
+size_t Utf8RankIndex::toByteOffset(size_t code_point) const {
+  if (code_point >= code_points) return bytes;
+
+  // The code point is in one of the blocks from its sample to the next one, take the last of them
+  // with no more code points before it
+  size_t j  = code_point / select_sample;
+  size_t b  = samples[j];
+  size_t hi = j + 1 < samples.size() ? samples[j + 1] : blocks.size() - 1;
+  while (b < hi) {
+    size_t mid = (b + hi + 1) / 2;
+    if (countBefore(mid) <= code_point) b = mid;
+    else hi = mid - 1;
+  }
+
+  // Select the remaining set bit inside the block
+  size_t k      = code_point - countBefore(b);
+  uint64_t bits = blockBits(b);
+#ifdef __BMI2__
+  bits = _pdep_u64(uint64_t(1) << k, bits);
+#else
+  for (; k > 0; k--) bits &= bits - 1;
+#endif
+  return b * block_bytes + std::countr_zero(bits);
+}
+
+size_t Utf8LineIndex::lineStart(size_t line) const {
+  if (line == 0) return 0;
+  if (line >= lineCount()) return chunks * u8simd::size();
+
+  // Block holding newline number line - 1 and the newline inside it, binary searched over the
+  // superblocks and then the blocks of one since lines have no bound on their length
+  size_t k   = line - 1;
+  auto super = std::upper_bound(superblocks.begin(), superblocks.end(), k) - 1;
+  size_t s   = super - superblocks.begin();
+
+  auto first = lines.begin() + s * blocks_per_super;
+  auto last  = lines.begin() + std::min(lines.size(), (s + 1) * blocks_per_super);
+  auto block = std::upper_bound(first + 1, last, uint16_t(k - *super)) - 1;
+  size_t b   = block - lines.begin();
+
+  uint64_t bits = newlines[b];
+  k -= *super + *block;
+#ifdef __BMI2__
+  bits = _pdep_u64(uint64_t(1) << k, bits);
+#else
+  for (; k > 0; k--) bits &= bits - 1;
+#endif
+  return b * block_bytes + std::countr_zero(bits) + 1;
+}
+
+LinePosition Utf8LineIndex::position(size_t byte_offset) const {
+  if (newlines.empty()) return { 0, byte_offset };
+  size_t b       = std::min(byte_offset / block_bytes, newlines.size() - 1);
+  size_t in_b    = byte_offset - b * block_bytes;
+  uint64_t below = in_b >= block_bytes ? newlines[b] : newlines[b] & ((uint64_t(1) << in_b) - 1);
+
+  size_t line = linesBefore(b) + std::popcount(below);
+  // The line start is in this block most of the time, otherwise select the previous newline
+  size_t start = below ? b * block_bytes + (block_bytes - std::countl_zero(below)) : lineStart(line);
+  return { line, byte_offset - start };
+}
+
+LinePosition Utf8LineIndex::position(size_t byte_offset, const Utf8RankIndex &index) const {
+  auto pos   = position(byte_offset);
+  pos.column = index.toCodePoint(byte_offset) - index.toCodePoint(byte_offset - pos.column);
+  return pos;
+}
+
+u8mask_vec mark_utf8_bytes2(u8simd_str &data, Utf8LineIndex &lines, uint32_t offset, MarkMode mode) {
+  mode = resolveMarkMode(mode, (data.size() - offset) * u8simd::size());
+
+  auto masks    = uninitialisedVector<u8mask>(data.size() - offset);
+  size_t blocks = lines.newlines.size() + masks.size() * u8simd::size() / Utf8LineIndex::block_bytes + 1;
+  lines.newlines.reserve(blocks);
+  lines.lines.reserve(blocks);
+  lines.superblocks.reserve(blocks / Utf8LineIndex::blocks_per_super + 1);
+
+  Utf8MarkState state;
+  mark_utf8_bytes2(u8simd_sv(data).substr(offset), masks.data(), state, lines, mode);
+  return releaseVector(std::move(masks));
+}
+
+void mark_utf8_bytes2(u8simd_sv data, u8mask *masks, Utf8MarkState &state, Utf8LineIndex &lines, MarkMode mode) {
+  if (resolveMarkMode(mode, data.size() * u8simd::size()) == MarkMode::Streaming) {
+    // The streaming pass marks a piece, the line index then reads its chunks while they are still in
+    // L2. Pieces are long enough for the prefetch distance of the streaming pass
+    constexpr size_t piece = (size_t(64) << 10) / sizeof(u8simd);
+    for (size_t i = 0; i < data.size(); i += piece) {
+      u8simd_sv chunks = data.substr(i, piece);
+      mark_utf8_bytes2(chunks, masks + i, state, MarkMode::Streaming);
+      for (const u8simd &chunk : chunks) lines.append(chunk);
+    }
+    return;
+  }
+  for (size_t i = 0; i < data.size(); i++) {
+    masks[i] = state.mark(data[i]);
+    lines.append(data[i]);
+  }
+}
@@ -1,56 +1,203 @@
 #include "utf8_skip.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <immintrin.h>
+
 alignas(stdx::memory_alignment_v<u8mask>) static constexpr std::array<bool, u8mask::size() * 2> mem{ true, true, true };
 
-std::vector<u8mask> mark_utf8_bytes2(u8simd_str &data, uint32_t offset) {
+u8mask_vec mark_utf8_bytes2(u8simd_str &data, uint32_t offset, MarkMode mode) {
   static u8mask mask_b1{ &mem[2], stdx::element_aligned };
   static u8mask mask_b2{ &mem[1], stdx::element_aligned };
   static u8mask mask_b3{ &mem[0], stdx::vector_aligned };
 
-  std::vector<u8mask> masks(data.size() - offset);
-  // This is very expensive on memory there is no need to maintain entire registers
-  u8simd overflow1{};
-  u8simd overflow2{};
-  u8simd overflow3{};
-  for (size_t i = offset; i < data.size(); i++) {
-    u8simd bytes = data[i];
+  mode = resolveMarkMode(mode, (data.size() - offset) * u8simd::size());
 
-    // Save the last bits of info which will overflow
+  auto masks = uninitialisedVector<u8mask>(data.size() - offset);
+  Utf8MarkState state;
+  mark_utf8_bytes2(u8simd_sv(data).substr(offset), masks.data(), state, mode);
+  return releaseVector(std::move(masks));
+}
 
-    auto byte_s1 = shiftElementRight<1>(bytes);
-    auto byte_s2 = shiftElementRight<2>(bytes);
-    auto byte_s3 = shiftElementRight<3>(bytes);
+// Stores the mask without pulling its line into the cache, needs an aligned destination
+static void streamMask(u8mask *dst, const u8mask &mask) {
+  if constexpr (sizeof(u8mask) == 32 && u8mask::size() == 32) {
+    _mm256_stream_si256((__m256i *)dst, (const __m256i &)mask);
+  } else if constexpr (sizeof(u8mask) == 16 && u8mask::size() == 16) {
+    _mm_stream_si128((__m128i *)dst, (const __m128i &)mask);
+  } else {
+    *dst = mask;
+  }
+}
 
-    // pretty damn skeptical of what this produces
-    // stdx::where(mask_b1, byte_s1) = overflow1;
-    // stdx::where(mask_b2, byte_s2) = overflow2;
-    // stdx::where(mask_b3, byte_s3) = overflow3;
+static void mark_utf8_bytes2_streaming(u8simd_sv data, u8mask *masks, Utf8MarkState &state) {
+  // Chunks per cache line and how far ahead the input is requested
+  static constexpr size_t line_chunks       = std::max<size_t>(64 / sizeof(u8simd), 1);
+  static constexpr size_t prefetch_distance = 4096 / sizeof(u8simd);
 
-    byte_s1 |= overflow1;
-    byte_s2 |= overflow2;
-    byte_s3 |= overflow3;
+  // Not aligned masks would fault on the streaming store, the loop below is the same otherwise
+  if (reinterpret_cast<uintptr_t>(masks) % alignof(u8mask) != 0)
+    return mark_utf8_bytes2(data, masks, state, MarkMode::Cached);
 
+  for (size_t i = 0; i < data.size(); i++) {
+    if (i % line_chunks == 0 && i + prefetch_distance < data.size())
+      _mm_prefetch((const char *)&data[i + prefetch_distance], _MM_HINT_T0);
+    streamMask(&masks[i], state.mark(data[i]));
+  }
+  // Streaming stores are weakly ordered, make them visible before anyone reads the masks
+  _mm_sfence();
+}
 
-    constexpr auto size = sizeof(u8simd::value_type);
-    u8mask mask         = masks[i];
-    // Identify lead bytes of UTF-8 sequences (0xxxxxxx or 11xxxxxx)
-    mask |= bytes >= 0xC0;  // Mark lead byte
-    mask |= byte_s1 >= 0xC0;  // Mark 2nd byte
-    mask |= byte_s2 >= 0xE0;  // Mark 3rd byte
-    mask |= byte_s3 >= 0xF0;  // Mark 4th byte
-    masks[i] = mask;
-
-    // Also I should be able to remove this shift just by reversing the overflow
-    overflow3 = shiftElementLeft<u8simd::size() - 3>(bytes);
-    overflow2 = shiftElementLeft<u8simd::size() - 2>(bytes);
-    overflow1 = shiftElementLeft<u8simd::size() - 1>(bytes);
+void mark_utf8_bytes2(u8simd_sv data, u8mask *masks, Utf8MarkState &state, MarkMode mode) {
+  if (resolveMarkMode(mode, data.size() * u8simd::size()) == MarkMode::Streaming)
+    return mark_utf8_bytes2_streaming(data, masks, state);
+  for (size_t i = 0; i < data.size(); i++) masks[i] = state.mark(data[i]);
+}
+
+void mark_utf8_bits(const uint8_t *data, size_t bytes, uint64_t *bits) {
+  constexpr size_t width = u8simd::size();
+  static_assert(64 % width == 0, "Chunks have to tile the 64 bit words");
+
+  Utf8MarkState state;
+  uint64_t word = 0;
+  size_t full   = bytes - bytes % width;
+  for (size_t i = 0; i < full; i += width) {
+    word |= maskBits(state.mark(u8simd(data + i, stdx::element_aligned))) << (i % 64);
+    if ((i + width) % 64 == 0) {
+      bits[i / 64] = word;
+      word         = 0;
+    }
+  }
+  if (full < bytes) {
+    alignas(u8simd) std::array<uint8_t, width> tail{};
+    std::memcpy(tail.data(), data + full, bytes - full);
+    uint64_t mask = maskBits(state.mark(u8simd(tail.data(), stdx::vector_aligned)));
+    word |= (mask & ((uint64_t(1) << (bytes - full)) - 1)) << (full % 64);
   }
-  return masks;
+  if (bytes % 64 != 0) bits[bytes / 64] = word;
 }
 
+// Length of the well formed sequence at i following table 3-7 of the Unicode standard, 0 if there is none
+static size_t sequenceLength(const uint8_t *data, size_t bytes, size_t i) {
+  uint8_t lead = data[i];
+  uint8_t lo   = 0x80;
+  uint8_t hi   = 0xBF;
+  size_t length;
+  if (lead < 0x80) return 1;
+  if (lead < 0xC2) return 0;
+  if (lead < 0xE0) length = 2;
+  else if (lead < 0xF0) {
+    length = 3;
+    if (lead == 0xE0) lo = 0xA0;
+    if (lead == 0xED) hi = 0x9F;
+  } else if (lead < 0xF5) {
+    length = 4;
+    if (lead == 0xF0) lo = 0x90;
+    if (lead == 0xF4) hi = 0x8F;
+  } else return 0;
+
+  if (bytes - i < length) return 0;
+  if (data[i + 1] < lo || data[i + 1] > hi) return 0;
+  for (size_t k = 2; k < length; k++)
+    if ((data[i + k] & 0xC0) != 0x80) return 0;
+  return length;
+}
+
+// Error classes of a byte pair, after Keiser and Lemire's lookup validation. The classes of the high
+// nibble of the first byte, its low nibble and the high nibble of the second byte are and-ed, a pair
+// is invalid when a class is left. two_conts is also set on a valid continuation after a continuation
+namespace utf8_error {
+constexpr uint8_t too_short      = 1 << 0;  // Lead byte not followed by a continuation
+constexpr uint8_t too_long       = 1 << 1;  // Continuation after an ASCII byte
+constexpr uint8_t overlong_3     = 1 << 2;  // E0 80..9F
+constexpr uint8_t too_large      = 1 << 3;  // F4 90..BF and F5..FF
+constexpr uint8_t surrogate      = 1 << 4;  // ED A0..BF
+constexpr uint8_t overlong_2     = 1 << 5;  // C0 and C1
+constexpr uint8_t too_large_1000 = 1 << 6;  // F5..FF 80..8F
+constexpr uint8_t overlong_4     = 1 << 6;  // F0 80..8F
+constexpr uint8_t two_conts      = 1 << 7;
+constexpr uint8_t carry          = too_short | too_long | two_conts;  // Only depend on the high nibbles
+}  // namespace utf8_error
+
+static __m256i nibbleTable(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint8_t b5, uint8_t b6,
+  uint8_t b7, uint8_t b8, uint8_t b9, uint8_t b10, uint8_t b11, uint8_t b12, uint8_t b13, uint8_t b14, uint8_t b15) {
+  return _mm256_broadcastsi128_si256(
+    _mm_setr_epi8(b0, b1, b2, b3, b4, b5, b6, b7, b8, b9, b10, b11, b12, b13, b14, b15));
+}
+
+// Non zero bytes where input, read after prev, breaks table 3-7. A sequence cut off at the end of
+// input isn't an error yet, it shows up with the next chunk
+static __m256i utf8Errors(__m256i input, __m256i prev) {
+  using namespace utf8_error;
+  const __m256i byte_1_high = nibbleTable(too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+    too_long, two_conts, two_conts, two_conts, two_conts, too_short | overlong_2, too_short,
+    too_short | overlong_3 | surrogate, too_short | too_large | too_large_1000 | overlong_4);
+  const __m256i byte_1_low = nibbleTable(carry | overlong_3 | overlong_2 | overlong_4, carry | overlong_2, carry,
+    carry, carry | too_large, carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000, carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000, carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000 | surrogate, carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000);
+  const __m256i byte_2_high = nibbleTable(too_short, too_short, too_short, too_short, too_short, too_short,
+    too_short, too_short, too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+    too_long | overlong_2 | two_conts | overlong_3 | too_large, too_long | overlong_2 | two_conts | surrogate | too_large,
+    too_long | overlong_2 | two_conts | surrogate | too_large, too_short, too_short, too_short, too_short);
+  const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+  // The bytes 1, 2 and 3 positions back, reaching into prev for the first ones
+  __m256i carried = _mm256_permute2x128_si256(prev, input, 0x21);
+  __m256i prev1   = _mm256_alignr_epi8(input, carried, 15);
+  __m256i prev2   = _mm256_alignr_epi8(input, carried, 14);
+  __m256i prev3   = _mm256_alignr_epi8(input, carried, 13);
+
+  __m256i special = _mm256_and_si256(
+    _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble)),
+      _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, low_nibble))),
+    _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble)));
+  // Third and fourth bytes of a sequence have to be the continuations flagged as two_conts above
+  __m256i third  = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80)));
+  __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80)));
+  __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(char(0x80)));
+  return _mm256_xor_si256(must_continue, special);
+}
+
+// Whether the last bytes of chunk start a sequence that goes on into the next chunk
+static bool endsIncomplete(__m256i chunk) {
+  const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, char(0xEF), char(0xDF), char(0xBF));
+  __m256i over = _mm256_subs_epu8(chunk, max);
+  return !_mm256_testz_si256(over, over);
+}
+
+size_t validate_utf8(const uint8_t *data, size_t bytes) {
+  constexpr size_t width = sizeof(__m256i);
+  __m256i prev           = _mm256_setzero_si256();
+  size_t i               = 0;
+  // Whole chunks are checked at once, ASCII ones after a complete sequence need no lookups
+  for (; i + width <= bytes; i += width) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+    if (_mm256_movemask_epi8(chunk) != 0 || endsIncomplete(prev)) {
+      __m256i errors = utf8Errors(chunk, prev);
+      if (!_mm256_testz_si256(errors, errors)) break;
+    }
+    prev = chunk;
+  }
+
+  // data[0, i) is valid up to a sequence it may end in the middle of. Back up to where that one starts
+  // and walk byte wise, which finds the offset of the error in the chunk or checks the tail
+  size_t start = i - std::min<size_t>(i, 3);
+  while (start < i && (data[start] & 0xC0) == 0x80) start++;
+  while (start < bytes) {
+    size_t length = sequenceLength(data, bytes, start);
+    if (length == 0) return start;
+    start += length;
+  }
+  return bytes;
+}
 
-std::vector<u8mask> mark_utf8_bytes(const u8simd_str &data) {
-  std::vector<u8mask> masks(data.size() + 1);  // 1 more because of overflow
+u8mask_vec mark_utf8_bytes(const u8simd_str &data) {
+  u8mask_vec masks(data.size() + 1, u8mask(false));  // 1 more because of overflow
   std::size_t i = 0;
 
   while (i < data.size()) {
@@ -0,0 +1,77 @@
+#include "utf8_skip_c.h"
+
+#include <cstddef>
+#include <new>
+
+#include "css_minify.hpp"
+#include "utf8_skip.hpp"
+
+// Spans are written straight into the caller's buffer
+static_assert(sizeof(u8s_span) == sizeof(CssStringSpan), "u8s_span has to match CssStringSpan");
+static_assert(offsetof(u8s_span, start) == offsetof(CssStringSpan, start), "u8s_span has to match CssStringSpan");
+static_assert(offsetof(u8s_span, end) == offsetof(CssStringSpan, end), "u8s_span has to match CssStringSpan");
+
+namespace {
+
+// Everything else in the library is compiled for AVX2, checked before any of it runs
+bool cpuSupported() {
+  static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return avx2;
+}
+
+// Exceptions must not unwind into the caller's runtime, whatever the body throws becomes a status
+template<typename Body>
+u8s_status guarded(Body &&body) noexcept {
+  try {
+    return body();
+  } catch (const std::bad_alloc &) {
+    return U8S_OUT_OF_MEMORY;
+  } catch (...) {
+    return U8S_INTERNAL_ERROR;
+  }
+}
+
+}  // namespace
+
+extern "C" {
+
+uint32_t u8s_abi_version(void) noexcept { return U8S_ABI_VERSION; }
+
+u8s_status u8s_mark_utf8(const uint8_t *data, size_t len, uint64_t *bits, size_t words) noexcept {
+  if (!cpuSupported()) return U8S_UNSUPPORTED_CPU;
+  if (len == 0) return U8S_OK;
+  if (data == nullptr || bits == nullptr) return U8S_INVALID_ARGUMENT;
+  if (words == 0) return U8S_BUFFER_TOO_SMALL;
+  // Marks only carry forward, so the bits of a prefix don't depend on what follows it
+  bool fits = words >= U8S_MARK_WORDS(len);
+  return guarded([&] {
+    mark_utf8_bits(data, fits ? len : words * 64, bits);
+    return fits ? U8S_OK : U8S_BUFFER_TOO_SMALL;
+  });
+}
+
+u8s_status u8s_validate_utf8(const uint8_t *data, size_t len, size_t *error_offset) noexcept {
+  if (!cpuSupported()) return U8S_UNSUPPORTED_CPU;
+  if (data == nullptr && len != 0) return U8S_INVALID_ARGUMENT;
+  return guarded([&] {
+    size_t offset = len == 0 ? 0 : validate_utf8(data, len);
+    if (error_offset != nullptr) *error_offset = offset;
+    return offset == len ? U8S_OK : U8S_INVALID_UTF8;
+  });
+}
+
+u8s_status u8s_index_css_strings(const uint8_t *data,
+  size_t len,
+  u8s_span *spans,
+  size_t capacity,
+  size_t *count) noexcept {
+  if (!cpuSupported()) return U8S_UNSUPPORTED_CPU;
+  if (count == nullptr || (data == nullptr && len != 0) || (spans == nullptr && capacity != 0))
+    return U8S_INVALID_ARGUMENT;
+  return guarded([&] {
+    *count = len == 0 ? 0 : indexCssStrings(data, len, reinterpret_cast<CssStringSpan *>(spans), capacity);
+    return *count <= capacity ? U8S_OK : U8S_BUFFER_TOO_SMALL;
+  });
+}
+
+}  // extern "C"
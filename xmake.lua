@@ -5,11 +5,34 @@ set_languages("c++23")
 set_toolchains("gcc", "clang")
 set_runtimes("stdc++_static")
 
+option("io_uring")
+  set_default(false)
+  set_showmenu(true)
+  set_description("Use io_uring (liburing) for pipelined file reads, pread workers otherwise")
+  add_links("uring")
+  add_defines("UTF8_SKIP_IO_URING")
+option_end()
+
 target("utf8_skip")
   set_kind("static")
   add_vectorexts("avx2")
   add_includedirs("$(projectdir)/include", { public = true })
-  add_files("src/utf8_skip.cpp")
+  add_files("src/utf8_skip.cpp", "src/block_reader.cpp", "src/utf8_index.cpp", "src/css_minify.cpp", "src/simd_allocator.cpp")
+  add_options("io_uring")
+  add_syslinks("pthread", { public = true })
+target_end()
+
+-- C ABI for embedding from other runtimes, see include/utf8_skip_c.h. Builds its own PIC objects
+-- and only exports the u8s_ functions
+target("utf8_skip_c")
+  set_kind("shared")
+  set_symbols("hidden")
+  add_vectorexts("avx2")
+  add_includedirs("$(projectdir)/include", { public = true })
+  add_headerfiles("include/utf8_skip_c.h")
+  -- Keeps the statically linked libstdc++ from being exported into the host process
+  add_shflags("-Wl,--exclude-libs,ALL")
+  add_files("src/utf8_skip_c.cpp", "src/utf8_skip.cpp", "src/css_minify.cpp", "src/simd_allocator.cpp")
 target_end()
 
 target("temp")